@@ -0,0 +1,190 @@
+/*!  \file mf_auth.cpp
+\brief authorizer role implementation
+\author zhaohongchao(zadezhao@qq.com)
+\date 2026/10/18 17:05:21
+\version 1.0.0.0
+\since 1.0.0.0
+*/
+#include "mf_auth.h"
+#include <string.h>//for strpbrk
+#include <stdio.h>//for snprintf
+
+//! anonymouse namespace
+namespace {
+
+//! to int len
+template<class T>
+int to_int_(T len) {
+    return static_cast<int>(len);
+}
+
+//! answer when no decision can be made, never allows
+const char INTERNAL_ERROR[] = "Status: 500 Internal Server Error\r\n\r\n";
+
+//! append header, reject CR/LF against header injection
+bool append_header_(std::string &response, const char *prefix, const std::string &name, const std::string &value) {
+    if (name.empty() || strpbrk(name.c_str(), "\r\n:") != NULL || strpbrk(value.c_str(), "\r\n") != NULL) {
+        return false;
+    }
+
+    response += prefix;
+    response += name;
+    response += ": ";
+    response += value;
+    response += "\r\n";
+
+    return true;
+}
+}
+
+//////////////////////////////////////////////////////////////////////////
+mf_auth_cache::mf_auth_cache(int shard_count, size_t max_entries)
+    : shards_(NULL), shard_count_(shard_count > 0 ? shard_count : 1), shard_limit_(max_entries / shard_count_ + 1) {
+    shards_ = new shard[shard_count_];
+
+    for (int i = 0; i != shard_count_; ++i) {
+        pthread_mutex_init(&shards_[i].lock, NULL);
+    }
+}
+
+mf_auth_cache::~mf_auth_cache() {
+    for (int i = 0; i != shard_count_; ++i) {
+        pthread_mutex_destroy(&shards_[i].lock);
+    }
+
+    delete[] shards_;
+}
+
+bool mf_auth_cache::find(uint64_t hash, const std::string &key, std::string &response) {
+    shard &cur = shards_[hash % shard_count_];
+    const int64_t now = mf_now_ms();
+    bool found = false;
+
+    pthread_mutex_lock(&cur.lock);
+
+    for (std::pair<entries_t::iterator, entries_t::iterator> range = cur.entries.equal_range(hash); range.first != range.second; ++range.first) {
+        entry &value = range.first->second;
+
+        if (value.key == key) {
+            if (value.expire_ms > now) {
+                response = value.response;
+                found = true;
+            } else {
+                cur.entries.erase(range.first);
+            }
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&cur.lock);
+
+    return found;
+}
+
+void mf_auth_cache::insert(uint64_t hash, const std::string &key, const std::string &response, int ttl_ms) {
+    shard &cur = shards_[hash % shard_count_];
+    const int64_t now = mf_now_ms();
+
+    pthread_mutex_lock(&cur.lock);
+
+    for (std::pair<entries_t::iterator, entries_t::iterator> range = cur.entries.equal_range(hash); range.first != range.second; ++range.first) {
+        if (range.first->second.key == key) {
+            cur.entries.erase(range.first);
+            break;
+        }
+    }
+
+    if (cur.entries.size() >= shard_limit_) { //evict the entry next to hash, a cheap random pick
+        entries_t::iterator victim = cur.entries.lower_bound(hash);
+        cur.entries.erase(victim != cur.entries.end() ? victim : cur.entries.begin());
+    }
+
+    entries_t::iterator itr = cur.entries.insert(std::make_pair(hash, entry()));
+    itr->second.key = key;
+    itr->second.response = response;
+    itr->second.expire_ms = now + ttl_ms;
+
+    pthread_mutex_unlock(&cur.lock);
+}
+
+void mf_auth_cache::clear() {
+    for (int i = 0; i != shard_count_; ++i) {
+        pthread_mutex_lock(&shards_[i].lock);
+        shards_[i].entries.clear();
+        pthread_mutex_unlock(&shards_[i].lock);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+mf_authorizer::mf_authorizer(int ttl_ms, int shard_count, size_t max_entries)
+    : cache_(shard_count, max_entries), ttl_ms_(ttl_ms) {
+}
+
+int mf_authorizer::encode(const mf_auth_result &result, std::string &response, const char *variable_prefix) {
+    char status[64];
+
+    if (result.allow) {
+        response.assign("Status: 200 OK\r\n");
+    } else {
+        snprintf(status, sizeof(status), "Status: %d\r\n", result.deny_status);
+        response.assign(status);
+    }
+
+    for (mf_headers_t::const_iterator itr = result.headers.begin(), end = result.headers.end(); itr != end; ++itr) {
+        if (!append_header_(response, "", itr->first, itr->second)) {
+            return MF_PARAMS_ERROR;
+        }
+    }
+
+    if (result.allow) {
+        for (mf_headers_t::const_iterator itr = result.variables.begin(), end = result.variables.end(); itr != end; ++itr) {
+            if (!append_header_(response, variable_prefix, itr->first, itr->second)) {
+                return MF_PARAMS_ERROR;
+            }
+        }
+    }
+
+    response += "\r\n";
+
+    return MF_OK;
+}
+
+int mf_authorizer::decide(mf_context *ctx, mf_reader *reader, mf_writer *writer, const char *variable_prefix) {
+    std::string key(variable_prefix); //answers of the two roles differ
+    std::string response;
+
+    for (std::vector<std::string>::const_iterator itr = key_params_.begin(), end = key_params_.end(); itr != end; ++itr) {
+        const mf_strview value = reader->param(itr->c_str());
+        const int len = (value.data ? value.len : -1); //missing differs from empty
+        key.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        key.append(value.data ? value.data : "", value.data ? value.len : 0);
+    }
+
+    const uint64_t hash = mf_hash(key.data(), key.size());
+
+    if (!cache_.find(hash, key, response)) {
+        mf_auth_result result;
+        result.ttl_ms = ttl_ms_;
+        int ret = authorize(ctx, reader, &result);
+
+        if (ret < 0 || (ret = encode(result, response, variable_prefix)) < 0) {
+            writer->write_finished_record(ctx, INTERNAL_ERROR, to_int_(sizeof(INTERNAL_ERROR) - 1));
+            return ret;
+        }
+
+        if (result.ttl_ms > 0 && !key_params_.empty()) { //no key params, no key to share a decision by
+            cache_.insert(hash, key, response, result.ttl_ms);
+        }
+    }
+
+    return writer->write_finished_record(ctx, response.data(), to_int_(response.size()));
+}
+
+int mf_authorizer::on_auth(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    return decide(ctx, reader, writer, "Variable-");
+}
+
+int mf_authorizer::on_response(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    return decide(ctx, reader, writer, "");
+}
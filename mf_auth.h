@@ -0,0 +1,203 @@
+/*!  \file mf_auth.h
+\brief authorizer role with decision cache for multithread fastcgi
+\author zhaohongchao(zadezhao@qq.com)
+\date 2026/10/18 17:05:21
+\version 1.0.0.0
+\since 1.0.0.0
+
+simple example:
+
+struct my_authorizer : public mf_authorizer {
+    my_authorizer() {
+        add_key_param("HTTP_AUTHORIZATION");
+    }
+
+    virtual int authorize(mf_context *ctx, mf_reader *reader, mf_auth_result *result){
+        result->allow = check_token(reader->param("HTTP_AUTHORIZATION"));
+        result->variables.push_back(std::make_pair("X-User", "john"));
+        return MF_OK;
+    }
+};
+
+both roles are answered: Authorizer gets "Variable-X-User: john", Responder(nginx auth_request,
+fastcgi always sends Responder) gets "X-User: john" for auth_request_set $upstream_http_x_user.
+
+*/
+#ifndef __MF_AUTH_H__
+#define __MF_AUTH_H__
+
+#include "mtfcgi.h"
+
+#include <map> // for shard entries
+#include <string> // for std::string
+#include <vector> // for vector
+#include <utility> // for std::pair
+#include <pthread.h> // for pthread_mutex_t
+#include <stdint.h> // for uint64_t
+
+//! header list type
+typedef std::vector<std::pair<std::string, std::string> > mf_headers_t;
+
+/*! authorizer decision
+*/
+struct mf_auth_result {
+    //! allow request
+    bool allow;
+
+    //! status when denied
+    int deny_status;
+
+    //! "Variable-name: value" headers passed to the web server when allowed
+    mf_headers_t variables;
+
+    //! other response headers, e.g. WWW-Authenticate
+    mf_headers_t headers;
+
+    //! cache time in millisecond, 0 for not cached
+    int ttl_ms;
+
+    //! ctor
+    mf_auth_result(): allow(false), deny_status(403), ttl_ms(0) {
+    }
+};
+
+/*! sharded ttl cache of encoded authorizer responses
+*/
+class mf_auth_cache {
+    /*! cached decision
+    */
+    struct entry {
+        //! key material, compared on hit so hash collision never shares a decision
+        std::string key;
+
+        //! encoded response
+        std::string response;
+
+        //! expire time point in millisecond
+        int64_t expire_ms;
+    };
+
+    //! entries of one shard
+    typedef std::multimap<uint64_t, entry> entries_t;
+
+    /*! shard with own lock
+    */
+    struct shard {
+        //! lock
+        pthread_mutex_t lock;
+
+        //! entries
+        entries_t entries;
+    };
+
+    //! shards
+    shard *shards_;
+
+    //! shard count
+    int shard_count_;
+
+    //! max entries of one shard
+    size_t shard_limit_;
+
+    //! noncopyable
+    mf_auth_cache(const mf_auth_cache &);
+    mf_auth_cache &operator=(const mf_auth_cache &);
+
+  public:
+
+    /*! ctor
+    \param shard_count   shard count, less than 1 for 1
+    \param max_entries   max entries of all shards
+    */
+    explicit mf_auth_cache(int shard_count = 16, size_t max_entries = 65536);
+
+    //! dtor
+    ~mf_auth_cache();
+
+    /*! find response
+    \param hash   hash of key
+    \param key   key material
+    \param response   encoded response
+    \return  true for found
+    */
+    bool find(uint64_t hash, const std::string &key, std::string &response);
+
+    /*! insert response
+    \param hash   hash of key
+    \param key   key material
+    \param response   encoded response
+    \param ttl_ms   cache time in millisecond
+    */
+    void insert(uint64_t hash, const std::string &key, const std::string &response, int ttl_ms);
+
+    //! drop all entries
+    void clear();
+};
+
+/*! authorizer handler answering Authorizer and Responder role, decisions are cached by
+configured params, nothing is cached until add_key_param() is called
+*/
+class mf_authorizer : public mf_handler {
+    //! params making up the cache key
+    std::vector<std::string> key_params_;
+
+    //! decision cache
+    mf_auth_cache cache_;
+
+    //! default cache time
+    int ttl_ms_;
+
+  public:
+
+    /*! ctor
+    \param ttl_ms   default cache time in millisecond, 0 for not cached
+    \param shard_count   cache shard count
+    \param max_entries   max cached decisions
+    */
+    explicit mf_authorizer(int ttl_ms = 1000, int shard_count = 16, size_t max_entries = 65536);
+
+    /*! add param to cache key, decision must depend on key params only
+    \param name   param name, e.g. HTTP_AUTHORIZATION
+    */
+    void add_key_param(const char *name) {
+        key_params_.push_back(name);
+    }
+
+    //! decision cache
+    mf_auth_cache &cache() {
+        return cache_;
+    }
+
+    /*! decide request not found in cache
+    \param ctx   mf_context object
+    \param reader  mtfcgi reader
+    \param result   decision, ttl_ms is preset to default cache time
+    \return >=0 for ok; others for error status in mf_status
+    */
+    virtual int authorize(mf_context *ctx, mf_reader *reader, mf_auth_result *result) = 0;
+
+    /*! encode decision to response
+    \param result   decision
+    \param response   encoded response
+    \param variable_prefix   prefix of variable headers, "Variable-" for Authorizer role
+    \return MF_OK for ok; MF_PARAMS_ERROR for bad header
+    */
+    static int encode(const mf_auth_result &result, std::string &response, const char *variable_prefix = "Variable-");
+
+    /*! answer from cache or authorize(), 500 is answered when no decision is made
+    \param ctx   mf_context object
+    \param reader  mtfcgi reader
+    \param writer  mtfcgi writer
+    \param variable_prefix   prefix of variable headers
+    \return >=0 for ok; others for error status in mf_status
+    */
+    int decide(mf_context *ctx, mf_reader *reader, mf_writer *writer, const char *variable_prefix);
+
+    //! answer Authorizer role with "Variable-" headers
+    virtual int on_auth(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+
+    //! answer Responder role(nginx auth_request) with plain headers
+    virtual int on_response(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+};
+
+#endif //__MF_AUTH_H__
@@ -0,0 +1,578 @@
+/*!  \file mf_form.cpp
+\brief form body parser implementation
+\author zhaohongchao(zadezhao@qq.com)
+\date 2026/10/18 14:36:05
+\version 1.0.0.0
+\since 1.0.0.0
+*/
+#include "mf_form.h"
+#include <string.h>//for memchr
+#include <strings.h>//for strncasecmp
+#include <unistd.h>//for write
+#include <errno.h>//for errno
+
+#ifdef __SSE2__
+#include <emmintrin.h>//for sse2
+#endif
+
+//! anonymouse namespace
+namespace {
+
+enum {
+    MAX_HEADERS_SIZE = 8192,/*!< max size of part headers . */
+    MAX_BOUNDARY_SIZE = 70,/*!< max size of boundary(rfc2046) . */
+};
+
+//! to int len
+template<class T>
+int to_int_(T len) {
+    return static_cast<int>(len);
+}
+
+//! find needle(at least 2 bytes), candidates are filtered by its first 2 bytes 16 at a time
+const char *find_(const char *data, int len, const char *needle, int needle_len) {
+    if (len < needle_len) {
+        return NULL;
+    }
+
+    const char *pos = data;
+    const char *end = data + len - needle_len + 1; //last candidate + 1
+
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i second = _mm_set1_epi8(needle[1]);
+
+    while (pos < end && data + len - pos > 16) {
+        const __m128i block0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+        const __m128i block1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos + 1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block0, first), _mm_cmpeq_epi8(block1, second)));
+
+        while (mask != 0) {
+            const char *candidate = pos + __builtin_ctz(mask);
+
+            if (candidate < end && memcmp(candidate + 2, needle + 2, needle_len - 2) == 0) {
+                return candidate;
+            }
+
+            mask &= mask - 1;
+        }
+
+        pos += 16;
+    }
+#endif
+
+    while (pos < end) {
+        pos = reinterpret_cast<const char *>(memchr(pos, needle[0], end - pos));
+
+        if (pos == NULL) {
+            break;
+        } else if (memcmp(pos + 1, needle + 1, needle_len - 1) == 0) {
+            return pos;
+        }
+
+        ++pos;
+    }
+
+    return NULL;
+}
+
+//! view starts with c string, ignore case
+bool starts_with_(const char *data, int len, const char *str) {
+    const int str_len = to_int_(strlen(str));
+    return len >= str_len && strncasecmp(data, str, str_len) == 0;
+}
+
+//! trim spaces
+void trim_(const char *&begin, const char *&end) {
+    while (begin < end && (*begin == ' ' || *begin == '\t')) {
+        ++begin;
+    }
+
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
+    }
+}
+
+//! write all data
+int write_all_(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        const ssize_t ret = ::write(fd, data, len);
+
+        if (ret > 0) {
+            data += ret;
+            len -= ret;
+        } else if (ret < 0 && errno != EINTR) {
+            return MF_WRITE_ERROR;
+        }
+    }
+
+    return MF_OK;
+}
+}
+
+//////////////////////////////////////////////////////////////////////////
+mf_form::mf_form(off_t spill_threshold, const char *spill_dir, size_t memory_limit)
+    : kind_(NONE), state_(PREAMBLE), in_place_(false), base_(NULL),
+      spill_threshold_(spill_threshold), memory_limit_(memory_limit), spill_dir_(spill_dir), spill_fd_(-1), spill_size_(0), headers_size_(0) {
+}
+
+mf_form::~mf_form() {
+    clear_();
+}
+
+void mf_form::clear_() {
+    if (spill_fd_ >= 0) {
+        close(spill_fd_);
+        spill_fd_ = -1;
+    }
+
+    spill_size_ = 0;
+    headers_size_ = 0;
+    parts_.clear();
+    fields_.clear();
+    values_.clear();
+    pending_.clear();
+    store_.clear();
+    arena_.reset();
+}
+
+int mf_form::begin(const mf_reader &reader) {
+    clear_();
+    kind_ = NONE;
+    state_ = PREAMBLE;
+    in_place_ = false;
+    base_ = NULL;
+
+    const mf_strview type = reader.param("CONTENT_TYPE");
+
+    if (type.data == NULL) {
+        return MF_PARAMS_ERROR;
+    } else if (starts_with_(type.data, type.len, "application/x-www-form-urlencoded")) {
+        kind_ = URLENCODED;
+        return MF_OK;
+    } else if (!starts_with_(type.data, type.len, "multipart/form-data")) {
+        return MF_PARAMS_ERROR;
+    }
+
+    const char *pos = type.data;
+    const char *end = type.data + type.len;
+
+    while (pos < end && !starts_with_(pos, to_int_(end - pos), "boundary=")) {
+        ++pos;
+    }
+
+    if (pos == end) {
+        return MF_PARAMS_ERROR;
+    }
+
+    const char *boundary = pos + 9;
+    const char *boundary_end = reinterpret_cast<const char *>(memchr(boundary, ';', end - boundary));
+
+    if (boundary_end == NULL) {
+        boundary_end = end;
+    }
+
+    trim_(boundary, boundary_end);
+
+    if (boundary_end - boundary >= 2 && *boundary == '"' && boundary_end[-1] == '"') {
+        ++boundary;
+        --boundary_end;
+    }
+
+    if (boundary == boundary_end || boundary_end - boundary > MAX_BOUNDARY_SIZE) {
+        return MF_PARAMS_ERROR;
+    }
+
+    delim_.assign("\r\n--");
+    delim_.append(boundary, boundary_end);
+    kind_ = MULTIPART;
+
+    return MF_OK;
+}
+
+size_t mf_form::keep_(const char *data, int len) {
+    if (in_place_) {
+        return data - base_;
+    }
+
+    const size_t offset = store_.size();
+    store_.insert(store_.end(), data, data + len);
+
+    return offset;
+}
+
+int mf_form::emit_(const char *data, int len) {
+    part &cur = parts_.back();
+
+    if (in_place_ || len == 0) { //in place value is contiguous
+        cur.size += len;
+        return MF_OK;
+    }
+
+    //spill big part, or any part once all kept values would pass the memory limit
+    //parts are streamed one after another, so a spilled part is contiguous in the shared file
+    if (cur.spill_off < 0 && (cur.size + len > spill_threshold_ || store_.size() + len > memory_limit_)) {
+        if (spill_fd_ < 0 && (spill_fd_ = mf_mktemp(spill_dir_.c_str())) < 0) {
+            return MF_WRITE_ERROR;
+        }
+
+        if (cur.size > 0 && write_all_(spill_fd_, &store_[cur.value_off], cur.size) < 0) {
+            return MF_WRITE_ERROR;
+        }
+
+        cur.spill_off = spill_size_;
+        spill_size_ += cur.size;
+        store_.resize(cur.value_off);
+    }
+
+    if (cur.spill_off >= 0) {
+        if (write_all_(spill_fd_, data, len) < 0) {
+            return MF_WRITE_ERROR;
+        }
+
+        spill_size_ += len;
+    } else {
+        store_.insert(store_.end(), data, data + len);
+    }
+
+    cur.size += len;
+
+    return MF_OK;
+}
+
+int mf_form::parse_headers_(const char *data, int len) {
+    part cur;
+    cur.name_off = cur.filename_off = cur.type_off = -1;
+    cur.name_len = cur.filename_len = cur.type_len = 0;
+    cur.value_off = 0;
+    cur.spill_off = -1;
+    cur.size = 0;
+
+    if (!in_place_ && (headers_size_ += len) > memory_limit_) { //headers of too many parts
+        return MF_PARAMS_ERROR;
+    }
+
+    const size_t offset = keep_(data, len);
+    const char *origin = (in_place_ ? base_ : (store_.empty() ? data : &store_[0]));
+    const char *line = origin + offset;
+    const char *end = line + len;
+
+    while (line < end) {
+        const char *line_end = find_(line, to_int_(end - line), "\r\n", 2);
+
+        if (line_end == NULL) {
+            line_end = end;
+        }
+
+        const char *colon = reinterpret_cast<const char *>(memchr(line, ':', line_end - line));
+
+        if (colon != NULL) {
+            const char *value = colon + 1;
+            const char *value_end = line_end;
+            trim_(value, value_end);
+
+            if (starts_with_(line, to_int_(colon - line), "Content-Type")) {
+                cur.type_off = to_int_(value - origin);
+                cur.type_len = to_int_(value_end - value);
+            } else if (starts_with_(line, to_int_(colon - line), "Content-Disposition")) {
+                while (value < value_end) { //form-data; name="a"; filename="b"
+                    const char *item_end = reinterpret_cast<const char *>(memchr(value, ';', value_end - value));
+
+                    if (item_end == NULL) {
+                        item_end = value_end;
+                    }
+
+                    const char *eq = reinterpret_cast<const char *>(memchr(value, '=', item_end - value));
+
+                    if (eq != NULL) {
+                        const char *key = value;
+                        const char *key_end = eq;
+                        const char *item = eq + 1;
+                        const char *item_value_end = item_end;
+                        trim_(key, key_end);
+                        trim_(item, item_value_end);
+
+                        if (item_value_end - item >= 2 && *item == '"' && item_value_end[-1] == '"') {
+                            ++item;
+                            --item_value_end;
+                        }
+
+                        if (key_end - key == 4 && strncasecmp(key, "name", 4) == 0) {
+                            cur.name_off = to_int_(item - origin);
+                            cur.name_len = to_int_(item_value_end - item);
+                        } else if (key_end - key == 8 && strncasecmp(key, "filename", 8) == 0) {
+                            cur.filename_off = to_int_(item - origin);
+                            cur.filename_len = to_int_(item_value_end - item);
+                        }
+                    }
+
+                    value = item_end + 1;
+                }
+            }
+        }
+
+        line = line_end + 2;
+    }
+
+    parts_.push_back(cur);
+
+    return MF_OK;
+}
+
+int mf_form::process_(const char *data, int len, bool last) {
+    const int delim_len = to_int_(delim_.size());
+    int pos = 0;
+
+    while (true) {
+        switch (state_) {
+            case PREAMBLE: { //first boundary has no leading CRLF
+                const char *found = find_(data + pos, len - pos, delim_.data() + 2, delim_len - 2);
+
+                if (found == NULL) {
+                    if (last) {
+                        return MF_PARAMS_ERROR;
+                    }
+
+                    return (len - (delim_len - 3) > pos ? len - (delim_len - 3) : pos);
+                }
+
+                pos = to_int_(found - data) + delim_len - 2;
+                state_ = DELIMITER;
+                break;
+            }
+
+            case DELIMITER:
+                if (len - pos < 2) {
+                    return (last ? MF_PARAMS_ERROR : pos);
+                } else if (data[pos] == '-' && data[pos + 1] == '-') {
+                    state_ = DONE;
+                } else if (data[pos] == '\r' && data[pos + 1] == '\n') {
+                    pos += 2;
+                    state_ = HEADERS;
+                } else {
+                    return MF_PARAMS_ERROR;
+                }
+
+                break;
+
+            case HEADERS: {
+                const char *headers = data + pos;
+                const char *body = NULL;
+                int headers_len = 0;
+
+                if (len - pos < 2) {
+                    return (last ? MF_PARAMS_ERROR : pos);
+                } else if (headers[0] == '\r' && headers[1] == '\n') { //no headers
+                    body = headers + 2;
+                } else {
+                    const char *found = find_(headers, len - pos, "\r\n\r\n", 4);
+
+                    if (found == NULL) {
+                        return ((last || len - pos > MAX_HEADERS_SIZE) ? MF_PARAMS_ERROR : pos);
+                    }
+
+                    headers_len = to_int_(found - headers);
+                    body = found + 4;
+                }
+
+                int ret = parse_headers_(headers, headers_len);
+
+                if (ret < 0) {
+                    return ret;
+                }
+
+                parts_.back().value_off = (in_place_ ? body - base_ : store_.size());
+                pos = to_int_(body - data);
+                state_ = BODY;
+                break;
+            }
+
+            case BODY: {
+                const char *found = find_(data + pos, len - pos, delim_.data(), delim_len);
+                int ret = 0;
+
+                if (found != NULL) {
+                    if ((ret = emit_(data + pos, to_int_(found - data) - pos)) < 0) {
+                        return ret;
+                    }
+
+                    pos = to_int_(found - data) + delim_len;
+                    state_ = DELIMITER;
+                    break;
+                } else if (last) {
+                    return MF_PARAMS_ERROR;
+                }
+
+                const int safe = len - (delim_len - 1); //keep what may be a partial delimiter
+
+                if (safe > pos) {
+                    if ((ret = emit_(data + pos, safe - pos)) < 0) {
+                        return ret;
+                    }
+
+                    pos = safe;
+                }
+
+                return pos;
+            }
+
+            case DONE: //ignore epilogue
+                return len;
+        }
+    }
+}
+
+void mf_form::split_(const char *data, int len) {
+    mf_params_t args;
+    mf_split_args(data, len, '&', false, args);
+
+    for (mf_params_t::const_iterator itr = args.begin(), end = args.end(); itr != end; ++itr) {
+        part cur;
+        cur.name_off = to_int_(itr->name.data - data);
+        cur.name_len = itr->name.len;
+        cur.filename_off = cur.type_off = -1;
+        cur.filename_len = cur.type_len = 0;
+        cur.value_off = itr->value.data - data;
+        cur.spill_off = -1;
+        cur.size = itr->value.len;
+        parts_.push_back(cur);
+    }
+}
+
+int mf_form::finish_() {
+    if (kind_ == MULTIPART && state_ != DONE) {
+        return MF_PARAMS_ERROR;
+    }
+
+    const char *origin = (in_place_ ? base_ : (store_.empty() ? NULL : &store_[0]));
+    const mf_strview none = {NULL, 0};
+
+    for (std::vector<part>::const_iterator itr = parts_.begin(), end = parts_.end(); itr != end; ++itr) {
+        mf_form_field field;
+        field.name = field.filename = field.content_type = field.value = none;
+
+        if (itr->name_off >= 0) {
+            field.name.data = origin + itr->name_off;
+            field.name.len = itr->name_len;
+        }
+
+        if (itr->filename_off >= 0) {
+            field.filename.data = origin + itr->filename_off;
+            field.filename.len = itr->filename_len;
+        }
+
+        if (itr->type_off >= 0) {
+            field.content_type.data = origin + itr->type_off;
+            field.content_type.len = itr->type_len;
+        }
+
+        if (itr->spill_off < 0) {
+            field.value.data = (origin ? origin + itr->value_off : "");
+            field.value.len = to_int_(itr->size);
+        }
+
+        field.fd = (itr->spill_off < 0 ? -1 : spill_fd_);
+        field.offset = (itr->spill_off < 0 ? 0 : itr->spill_off);
+        field.size = itr->size;
+        fields_.push_back(field);
+    }
+
+    values_.assign(fields_.size(), none);
+
+    return MF_OK;
+}
+
+int mf_form::on_data(mf_context *ctx, const char *data, int len) {
+    const bool last = (data == NULL);
+
+    if (kind_ == URLENCODED) { //small by nature, kept in memory up to spill threshold
+        if (last) {
+            split_(store_.empty() ? NULL : &store_[0], to_int_(store_.size()));
+            return finish_();
+        } else if (static_cast<off_t>(store_.size() + len) > spill_threshold_) {
+            return MF_PARAMS_ERROR;
+        }
+
+        store_.insert(store_.end(), data, data + len);
+        return MF_OK;
+    } else if (kind_ != MULTIPART) {
+        return MF_PARAMS_ERROR;
+    }
+
+    int ret = 0;
+
+    if (pending_.empty() && !last) { //parse from record directly, keep the rest
+        if ((ret = process_(data, len, false)) >= 0) {
+            pending_.assign(data + ret, data + len);
+        }
+    } else {
+        pending_.insert(pending_.end(), data, data + len);
+
+        if ((ret = process_(pending_.empty() ? "" : &pending_[0], to_int_(pending_.size()), last)) >= 0) {
+            pending_.erase(pending_.begin(), pending_.begin() + ret);
+        }
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    return (last ? finish_() : MF_OK);
+}
+
+int mf_form::parse(const mf_reader &reader) {
+    int ret = begin(reader);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    const mfbuf_t &input = reader.request_stdin();
+    in_place_ = true;
+    base_ = (input.empty() ? "" : &input[0]);
+
+    if (kind_ == URLENCODED) {
+        split_(base_, to_int_(input.size()));
+    } else if ((ret = process_(base_, to_int_(input.size()), true)) < 0) {
+        return ret;
+    }
+
+    return finish_();
+}
+
+const mf_form_field *mf_form::field(const char *name) const {
+    const int len = to_int_(strlen(name));
+
+    for (mf_form_fields_t::const_iterator itr = fields_.begin(), end = fields_.end(); itr != end; ++itr) {
+        if (itr->name.len == len && memcmp(itr->name.data, name, len) == 0) {
+            return &*itr;
+        }
+    }
+
+    return NULL;
+}
+
+mf_strview mf_form::value(const char *name) {
+    const mf_form_field *found = field(name);
+    const mf_strview none = {NULL, 0};
+
+    if (found == NULL) {
+        return none;
+    } else if (kind_ != URLENCODED) {
+        return found->value;
+    }
+
+    mf_strview &value = values_[found - &fields_[0]];
+
+    if (value.data == NULL) {
+        value = found->value;
+
+        if (memchr(value.data, '%', value.len) != NULL || memchr(value.data, '+', value.len) != NULL) {
+            char *buf = arena_.alloc(value.len);
+            value.len = mf_url_decode(value.data, value.len, buf, true);
+            value.data = buf;
+        }
+    }
+
+    return value;
+}
@@ -0,0 +1,239 @@
+/*!  \file mf_form.h
+\brief form body parser for multithread fastcgi
+\author zhaohongchao(zadezhao@qq.com)
+\date 2026/10/18 14:36:05
+\version 1.0.0.0
+\since 1.0.0.0
+
+parse buffered stdin, field values are views into request_stdin():
+
+    mf_form form;
+    if (form.parse(*reader) == MF_OK) {
+        mf_strview user = form.value("user");
+    }
+
+stream stdin, big parts are spilled to one temp file shared by the form:
+
+struct upload_handler : public mf_handler {
+    mf_form form;
+
+    virtual mf_stream_sink *stdin_sink(mf_context *ctx, mf_reader *reader, mf_writer *writer){
+        return form.begin(*reader) == MF_OK ? &form : NULL;
+    }
+
+    virtual int on_response(mf_context *ctx, mf_reader *reader, mf_writer *writer){
+        if (reader->sink_status() < 0) {//malformed or too big body
+            return writer->write_finished_record(ctx, NULL, 0, "Status: 400 Bad Request\r\n\r\n");
+        }
+
+        const mf_form_field *file = form.field("file");
+        if (file && file->fd >= 0) {
+            pread(file->fd, buf, file->size, file->offset);//part is at offset of the shared file
+        }
+        ...
+    }
+};
+
+*/
+#ifndef __MF_FORM_H__
+#define __MF_FORM_H__
+
+#include "mtfcgi.h"
+
+#include <string> // for std::string
+#include <vector> // for vector
+#include <sys/types.h> //for off_t
+
+/*! form field
+*/
+struct mf_form_field {
+    //! field name
+    mf_strview name;
+
+    //! file name of file part, data is NULL for others
+    mf_strview filename;
+
+    //! content type of part, data is NULL for none
+    mf_strview content_type;
+
+    //! field value, data is NULL when spilled to file
+    mf_strview value;
+
+    //! spill file shared by spilled fields and owned by mf_form, -1 for in memory
+    int fd;
+
+    //! value offset in fd
+    off_t offset;
+
+    //! value size
+    off_t size;
+};
+
+//! form fields type
+typedef std::vector<mf_form_field> mf_form_fields_t;
+
+/*! application/x-www-form-urlencoded and multipart/form-data body parser by CONTENT_TYPE
+*/
+class mf_form : public mf_stream_sink {
+    /*! parser kind
+    */
+    enum kind {
+        NONE,/*!< unsupported content type . */
+        URLENCODED,/*!< application/x-www-form-urlencoded . */
+        MULTIPART/*!< multipart/form-data . */
+    };
+
+    /*! multipart parser state
+    */
+    enum state {
+        PREAMBLE,/*!< before first boundary . */
+        DELIMITER,/*!< after boundary . */
+        HEADERS,/*!< part headers . */
+        BODY,/*!< part body . */
+        DONE/*!< after close boundary . */
+    };
+
+    /*! field with offsets, resolved to views when finished
+    */
+    struct part {
+        //! offset and len of name, filename, content type
+        int name_off, name_len, filename_off, filename_len, type_off, type_len;
+
+        //! offset of value
+        size_t value_off;
+
+        //! value offset in spill file, -1 for in memory
+        off_t spill_off;
+
+        //! value size
+        off_t size;
+    };
+
+    //! parser kind
+    kind kind_;
+
+    //! multipart state
+    state state_;
+
+    //! "\r\n--" + boundary
+    std::string delim_;
+
+    //! parse buffered input in place
+    bool in_place_;
+
+    //! buffered input
+    const char *base_;
+
+    //! unconsumed streamed input
+    mfbuf_t pending_;
+
+    //! streamed headers and values
+    mfbuf_t store_;
+
+    //! parts with offsets into base_ or store_
+    std::vector<part> parts_;
+
+    //! result fields
+    mf_form_fields_t fields_;
+
+    //! decoded values of urlencoded fields, data is NULL for not decoded yet
+    std::vector<mf_strview> values_;
+
+    //! memory of decoded values
+    mf_arena arena_;
+
+    //! part bigger than it is spilled
+    off_t spill_threshold_;
+
+    //! max bytes of streamed headers and values kept in memory
+    size_t memory_limit_;
+
+    //! directory of spill file
+    std::string spill_dir_;
+
+    //! spill file of all spilled parts, -1 for none
+    int spill_fd_;
+
+    //! bytes written to spill file
+    off_t spill_size_;
+
+    //! bytes of streamed part headers
+    size_t headers_size_;
+
+    //! keep data, return offset
+    size_t keep_(const char *data, int len);
+
+    //! append value of current part
+    int emit_(const char *data, int len);
+
+    //! parse part headers
+    int parse_headers_(const char *data, int len);
+
+    //! run multipart parser, return consumed bytes
+    int process_(const char *data, int len, bool last);
+
+    //! split urlencoded fields
+    void split_(const char *data, int len);
+
+    //! resolve fields from parts
+    int finish_();
+
+    //! close spilled files
+    void clear_();
+
+    //! noncopyable
+    mf_form(const mf_form &);
+    mf_form &operator=(const mf_form &);
+
+  public:
+
+    /*! ctor
+    \param spill_threshold   streamed part bigger than it is spilled to temp file
+    \param spill_dir   directory of spill file
+    \param memory_limit   streamed values are spilled once memory kept for all parts would pass it,
+    part headers passing it in total are an error
+    */
+    explicit mf_form(off_t spill_threshold = 1 << 20, const char *spill_dir = "/tmp", size_t memory_limit = 4 << 20);
+
+    //! dtor
+    virtual ~mf_form();
+
+    /*! prepare for streaming stdin by CONTENT_TYPE, then return this from mf_handler::stdin_sink
+    \param reader   mtfcgi reader with params
+    \return MF_OK for ok; MF_PARAMS_ERROR for unsupported content type
+    */
+    int begin(const mf_reader &reader);
+
+    /*! receive streamed stdin
+    \param ctx   mf_context object
+    \param data   content; NULL for end of stream
+    \param len   content len; 0 for end of stream
+    \return >=0 for ok; others for error status in mf_status
+    */
+    virtual int on_data(mf_context *ctx, const char *data, int len);
+
+    /*! parse buffered request_stdin() in place
+    \param reader   mtfcgi reader with params and stdin
+    \return MF_OK for ok; MF_PARAMS_ERROR for bad body or unsupported content type
+    */
+    int parse(const mf_reader &reader);
+
+    //! fields
+    const mf_form_fields_t &fields() const {
+        return fields_;
+    }
+
+    /*! find field
+    \param name   field name
+    \return  field; NULL for not found
+    */
+    const mf_form_field *field(const char *name) const;
+
+    /*! find field value, urlencoded value is percent-decoded on first read
+    \param name   field name
+    \return  view of value, data is NULL for not found or spilled
+    */
+    mf_strview value(const char *name);
+};
+
+#endif //__MF_FORM_H__
@@ -0,0 +1,246 @@
+/*!  \file mf_router.cpp
+\brief uri router implementation
+\author zhaohongchao(zadezhao@qq.com)
+\date 2026/10/18 10:12:40
+\version 1.0.0.0
+\since 1.0.0.0
+*/
+#include "mf_router.h"
+#include <string.h>//for memchr
+
+//! anonymouse namespace
+namespace {
+
+//! answer for no route
+const char NOT_FOUND[] = "Status: 404 Not Found\r\nContent-type: text/plain\r\n\r\nNot Found";
+
+//! to int len
+template<class T>
+int to_int_(T len) {
+    return static_cast<int>(len);
+}
+}
+
+//////////////////////////////////////////////////////////////////////////
+mf_router::mf_router(const char *uri_param): nodes_(1), uri_param_(uri_param), default_(NULL) {
+}
+
+int mf_router::add_name_(const char *name, int len) {
+    names_.push_back(std::string(name, len));
+    return to_int_(names_.size()) - 1;
+}
+
+int mf_router::insert_static_(int n, const char *text, int len) {
+    while (len > 0) {
+        const size_t pos = nodes_[n].firsts.find(text[0]);
+
+        if (pos == std::string::npos) {
+            const int child = to_int_(nodes_.size());
+            nodes_.push_back(node());
+            nodes_[child].label.assign(text, len);
+            nodes_[n].firsts.push_back(text[0]);
+            nodes_[n].children.push_back(child);
+            return child;
+        }
+
+        const int child = nodes_[n].children[pos];
+        const int label_len = to_int_(nodes_[child].label.size());
+        int common = 1;
+
+        while (common < len && common < label_len && nodes_[child].label[common] == text[common]) {
+            ++common;
+        }
+
+        if (common < label_len) { //split child, tail keeps its routes
+            const int tail = to_int_(nodes_.size());
+            nodes_.push_back(nodes_[child]);
+            nodes_[tail].label.erase(0, common);
+
+            node head;
+            head.label.assign(text, common);
+            head.firsts.assign(1, nodes_[tail].label[0]);
+            head.children.assign(1, tail);
+            nodes_[child] = head;
+        }
+
+        n = child;
+        text += common;
+        len -= common;
+    }
+
+    return n;
+}
+
+int mf_router::add(const char *pattern, mf_handler *handler) {
+    if (pattern == NULL || handler == NULL || *pattern != '/') {
+        return MF_ERROR;
+    }
+
+    int n = 0;
+    const char *pos = pattern;
+
+    while (*pos != '\0') {
+        if (*pos == ':') {
+            const char *name = ++pos;
+
+            while (*pos != '\0' && *pos != '/') {
+                ++pos;
+            }
+
+            if (pos == name) {
+                return MF_ERROR;
+            }
+
+            if (nodes_[n].segment < 0) {
+                const int child = to_int_(nodes_.size());
+                nodes_.push_back(node());
+                nodes_[child].name = add_name_(name, to_int_(pos - name));
+                nodes_[n].segment = child;
+            } else if (names_[nodes_[nodes_[n].segment].name] != std::string(name, pos)) {
+                return MF_ERROR;
+            }
+
+            n = nodes_[n].segment;
+        } else if (*pos == '*') {
+            const char *name = ++pos;
+            const int len = to_int_(strlen(name));
+
+            if (len == 0 || strpbrk(name, "/:*") != NULL || nodes_[n].rest != NULL) {
+                return MF_ERROR;
+            }
+
+            nodes_[n].rest = handler;
+            nodes_[n].rest_name = add_name_(name, len);
+            return MF_OK;
+        } else {
+            const char *text = pos;
+
+            while (*pos != '\0' && *pos != ':' && *pos != '*') {
+                ++pos;
+            }
+
+            n = insert_static_(n, text, to_int_(pos - text));
+        }
+    }
+
+    if (nodes_[n].handler != NULL) {
+        return MF_ERROR;
+    }
+
+    nodes_[n].handler = handler;
+
+    return MF_OK;
+}
+
+mf_handler *mf_router::match_(int n, const char *pos, const char *end, mf_params_t &args) const {
+    const node &cur = nodes_[n];
+
+    if (pos == end) {
+        if (cur.handler != NULL) {
+            return cur.handler;
+        }
+    } else {
+        const char *first = reinterpret_cast<const char *>(memchr(cur.firsts.data(), *pos, cur.firsts.size()));
+
+        if (first != NULL) {
+            const int child = cur.children[first - cur.firsts.data()];
+            const std::string &label = nodes_[child].label;
+            const int len = to_int_(label.size());
+
+            if (end - pos >= len && memcmp(label.data(), pos, len) == 0) {
+                mf_handler *handler = match_(child, pos + len, end, args);
+
+                if (handler != NULL) {
+                    return handler;
+                }
+            }
+        }
+
+        if (cur.segment >= 0) {
+            const char *seg_end = reinterpret_cast<const char *>(memchr(pos, '/', end - pos));
+
+            if (seg_end == NULL) {
+                seg_end = end;
+            }
+
+            if (seg_end != pos) {
+                const std::string &name = names_[nodes_[cur.segment].name];
+                mf_param arg = {{name.data(), to_int_(name.size())}, {pos, to_int_(seg_end - pos)}};
+                args.push_back(arg);
+                mf_handler *handler = match_(cur.segment, seg_end, end, args);
+
+                if (handler != NULL) {
+                    return handler;
+                }
+
+                args.pop_back();
+            }
+        }
+    }
+
+    if (cur.rest != NULL) {
+        const std::string &name = names_[cur.rest_name];
+        mf_param arg = {{name.data(), to_int_(name.size())}, {pos, to_int_(end - pos)}};
+        args.push_back(arg);
+        return cur.rest;
+    }
+
+    return NULL;
+}
+
+mf_handler *mf_router::match(const char *uri, int len, mf_params_t &args) const {
+    args.clear();
+    return match_(0, uri, uri + len, args);
+}
+
+mf_handler *mf_router::route_(mf_reader *reader) const {
+    mf_handler *handler = NULL;
+
+    if (reader->routed(handler)) { //matched by a sink hook already
+        return handler;
+    }
+
+    mf_params_t &args = reader->route_args();
+    const mf_strview uri = reader->param(uri_param_.c_str());
+    args.clear();
+
+    if (uri.data != NULL) {
+        const char *end = reinterpret_cast<const char *>(memchr(uri.data, '?', uri.len));
+        handler = match_(0, uri.data, end ? end : uri.data + uri.len, args);
+    }
+
+    handler = (handler ? handler : default_);
+    reader->set_routed(handler);
+
+    return handler;
+}
+
+mf_stream_sink *mf_router::stdin_sink(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    mf_handler *handler = route_(reader);
+    return handler ? handler->stdin_sink(ctx, reader, writer) : mf_handler::stdin_sink(ctx, reader, writer);
+}
+
+mf_stream_sink *mf_router::data_sink(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    mf_handler *handler = route_(reader);
+    return handler ? handler->data_sink(ctx, reader, writer) : mf_handler::data_sink(ctx, reader, writer);
+}
+
+int mf_router::on_response(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    mf_handler *handler = route_(reader);
+
+    if (handler == NULL) {
+        return writer->write_finished_record(ctx, NOT_FOUND, to_int_(sizeof(NOT_FOUND) - 1));
+    }
+
+    return handler->on_response(ctx, reader, writer);
+}
+
+int mf_router::on_auth(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    mf_handler *handler = route_(reader);
+    return handler ? handler->on_auth(ctx, reader, writer) : mf_handler::on_auth(ctx, reader, writer);
+}
+
+int mf_router::on_filter(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    mf_handler *handler = route_(reader);
+    return handler ? handler->on_filter(ctx, reader, writer) : mf_handler::on_filter(ctx, reader, writer);
+}
@@ -0,0 +1,142 @@
+/*!  \file mf_router.h
+\brief uri router for multithread fastcgi
+\author zhaohongchao(zadezhao@qq.com)
+\date 2026/10/18 10:12:40
+\version 1.0.0.0
+\since 1.0.0.0
+
+simple example:
+
+struct user_handler : public mf_handler {
+    virtual int on_response(mf_context *ctx, mf_reader *reader, mf_writer *writer){
+        mf_strview id = reader->route_arg("id");
+        return writer->write_finished_record(ctx, id.data, id.len, "Content-type: text/plain\r\n\r\n");
+    }
+};
+
+mf_router router;
+user_handler users;
+router.add("/users/:id", &users);
+
+mtfcgi mf;
+mf.handle(fd, TIMEOUT_MS, &router);
+
+*/
+#ifndef __MF_ROUTER_H__
+#define __MF_ROUTER_H__
+
+#include "mtfcgi.h"
+
+#include <deque> // for names
+#include <string> // for std::string
+#include <vector> // for vector
+
+/*! uri router, patterns are compiled into a radix trie and matched on raw uri bytes
+
+pattern is made of static text, ":name" for one path segment and "*name" for the rest of uri(last only).
+static text is tried first, then segment, then rest. routes must be added before handling requests,
+match is read only and can be shared by threads.
+*/
+class mf_router : public mf_handler {
+    /*! trie node
+    */
+    struct node {
+        //! static text from parent
+        std::string label;
+
+        //! first bytes of static children
+        std::string firsts;
+
+        //! static children, same order as firsts
+        std::vector<int> children;
+
+        //! child for ":name", -1 for none
+        int segment;
+
+        //! name index of ":name" for segment node, -1 for others
+        int name;
+
+        //! handler for "*name", NULL for none
+        mf_handler *rest;
+
+        //! name index of "*name"
+        int rest_name;
+
+        //! handler ends here, NULL for none
+        mf_handler *handler;
+
+        //! ctor
+        node(): segment(-1), name(-1), rest(NULL), rest_name(-1), handler(NULL) {
+        }
+    };
+
+    //! trie nodes, 0 is root
+    std::vector<node> nodes_;
+
+    //! capture names, deque keeps address
+    std::deque<std::string> names_;
+
+    //! param holding the uri
+    std::string uri_param_;
+
+    //! handler for no route
+    mf_handler *default_;
+
+    //! insert static text under node
+    int insert_static_(int n, const char *text, int len);
+
+    //! add capture name
+    int add_name_(const char *name, int len);
+
+    //! match uri from node
+    mf_handler *match_(int n, const char *pos, const char *end, mf_params_t &args) const;
+
+    //! route request and set route args, matched once per request
+    mf_handler *route_(mf_reader *reader) const;
+
+  public:
+
+    /*! ctor
+    \param uri_param   param holding the uri, query after '?' is ignored
+    */
+    explicit mf_router(const char *uri_param = "REQUEST_URI");
+
+    /*! add route
+    \param pattern   route pattern
+    \param handler   handler for route
+    \return  MF_OK for ok; MF_ERROR for bad pattern or conflicted with other route
+    */
+    int add(const char *pattern, mf_handler *handler);
+
+    /*! set handler when no route matched, 404 is answered by default
+    \param handler   handler
+    */
+    void set_default(mf_handler *handler) {
+        default_ = handler;
+    }
+
+    /*! match uri
+    \param uri   uri without query
+    \param len   uri len
+    \param args   captured path segments
+    \return  handler of route; NULL for no route
+    */
+    mf_handler *match(const char *uri, int len, mf_params_t &args) const;
+
+    //! route stdin streaming
+    virtual mf_stream_sink *stdin_sink(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+
+    //! route filter data streaming
+    virtual mf_stream_sink *data_sink(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+
+    //! route Responder
+    virtual int on_response(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+
+    //! route Authorizer
+    virtual int on_auth(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+
+    //! route Filter
+    virtual int on_filter(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+};
+
+#endif //__MF_ROUTER_H__
@@ -0,0 +1,84 @@
+/*!  \file mf_trace.cpp
+\brief request tracing implementation
+\author zhaohongchao(zadezhao@qq.com)
+\date 2026/10/18 20:41:17
+\version 1.0.0.0
+\since 1.0.0.0
+*/
+#include "mf_trace.h"
+#include <string.h>//for memset
+#include <time.h>//for clock_gettime
+
+//////////////////////////////////////////////////////////////////////////
+int64_t mf_trace_now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+//////////////////////////////////////////////////////////////////////////
+mf_trace_ring::mf_trace_ring(size_t size, int threshold_ms, FILE *out)
+    : slots_(size > 0 ? size : 1), head_(0), threshold_us_(threshold_ms * 1000), out_(out) {
+    memset(&current_, 0, sizeof(current_));
+
+    for (std::vector<slot>::iterator itr = slots_.begin(), end = slots_.end(); itr != end; ++itr) {
+        itr->seq = 0;
+    }
+}
+
+mf_span *mf_trace_ring::begin() {
+    memset(&current_, 0, sizeof(current_));
+    current_.start_us = mf_trace_now_us();
+    return &current_;
+}
+
+void mf_trace_ring::commit() {
+    current_.total_us = current_.elapsed_us();
+    slot &cur = slots_[head_ % slots_.size()];
+
+    //seqlock, readers retry or skip slot while seq is odd or changed
+    cur.seq = cur.seq + 1;
+    __sync_synchronize();
+    cur.span = current_;
+    __sync_synchronize();
+    cur.seq = cur.seq + 1;
+    head_ = head_ + 1;
+
+    if (threshold_us_ > 0 && current_.total_us >= threshold_us_ && out_ != NULL) {
+        print(current_, out_);
+    }
+}
+
+void mf_trace_ring::print(const mf_span &span, FILE *out) {
+    fprintf(out, "mtfcgi span id=%d role=%d header=%dus(%d) params=%dus(%d) stdin=%dus(%d) handler=%dus(%d) "
+            "write=%dus out=%d total=%dus app_status=%d protocol_status=%d\n",
+            span.request_id, span.role, span.header_us, span.header_ret, span.params_us, span.params_ret,
+            span.stdin_us, span.stdin_ret, span.handler_us, span.handler_ret,
+            span.write_us, span.bytes_out, span.total_us, span.app_status, span.protocol_status);
+}
+
+size_t mf_trace_ring::dump(FILE *out) const {
+    const unsigned long head = head_;
+    const unsigned long size = slots_.size();
+    size_t printed = 0;
+
+    for (unsigned long i = (head > size ? head - size : 0); i != head; ++i) {
+        const slot &cur = slots_[i % size];
+        const unsigned seq = cur.seq;
+
+        if ((seq & 1) != 0) { //being written
+            continue;
+        }
+
+        __sync_synchronize();
+        const mf_span span = cur.span;
+        __sync_synchronize();
+
+        if (cur.seq == seq) {
+            print(span, out);
+            ++printed;
+        }
+    }
+
+    return printed;
+}
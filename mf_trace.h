@@ -0,0 +1,171 @@
+/*!  \file mf_trace.h
+\brief request tracing for multithread fastcgi
+\author zhaohongchao(zadezhao@qq.com)
+\date 2026/10/18 20:41:17
+\version 1.0.0.0
+\since 1.0.0.0
+
+static tracepoints(provider mtfcgi) are compiled in with -DMTFCGI_USDT and <sys/sdt.h>,
+they cost a nop when nothing is attached:
+
+    bpftrace -e 'usdt:./app:mtfcgi:handler { @[arg1] = count(); }'
+
+probes: request__start(fd), header(request_id, type), params(request_id, ret),
+stdin(request_id, ret), handler(request_id, app_status), write(request_id, bytes),
+request__done(request_id, app_status)
+
+recent spans of one thread:
+
+    mf_trace_ring ring(1024, 100);//dump span slower than 100ms to stderr
+    mf.trace = &ring;
+    ...
+    ring.dump(stderr);//from any thread
+
+*/
+#ifndef __MF_TRACE_H__
+#define __MF_TRACE_H__
+
+#include <stdio.h> // for FILE
+#include <stdint.h> // for int64_t
+#include <vector> // for vector
+
+#ifdef MTFCGI_USDT
+#include <sys/sdt.h>
+#define MF_TRACE_PROBE1(name, a) STAP_PROBE1(mtfcgi, name, a)
+#define MF_TRACE_PROBE2(name, a, b) STAP_PROBE2(mtfcgi, name, a, b)
+#else
+#define MF_TRACE_PROBE1(name, a) do {} while (0)
+#define MF_TRACE_PROBE2(name, a, b) do {} while (0)
+#endif
+
+/*! fire probe of stage and record it in span of ctx
+\param ctx   mf_context object
+\param stage   header, params, stdin or handler
+\param ret   result of stage
+*/
+#define MF_TRACE_STAGE(ctx, stage, ret) \
+    do { \
+        MF_TRACE_PROBE2(stage, (ctx).request_id, (ret)); \
+        if ((ctx).span) { \
+            (ctx).span->stage##_us = (ctx).span->elapsed_us(); \
+            (ctx).span->stage##_ret = (ret); \
+        } \
+    } while (0)
+
+//! monotonic time in microsecond
+int64_t mf_trace_now_us();
+
+/*! timing of one request, stage times are microseconds since start
+*/
+struct mf_span {
+    //! start time
+    int64_t start_us;
+
+    //! request id
+    int request_id;
+
+    //! role
+    int role;
+
+    //! header read, 0 for not reached
+    int header_us;
+
+    //! record type of header
+    int header_ret;
+
+    //! params read, 0 for not reached
+    int params_us;
+
+    //! bytes readed or error status
+    int params_ret;
+
+    //! stdin read, 0 for not reached
+    int stdin_us;
+
+    //! bytes readed or error status
+    int stdin_ret;
+
+    //! handler returned, 0 for not reached
+    int handler_us;
+
+    //! handler result
+    int handler_ret;
+
+    //! time spent in write
+    int write_us;
+
+    //! bytes written
+    int bytes_out;
+
+    //! request done
+    int total_us;
+
+    //! app status
+    int app_status;
+
+    //! protocol status
+    int protocol_status;
+
+    //! elapsed time since start
+    int elapsed_us() const {
+        return static_cast<int>(mf_trace_now_us() - start_us);
+    }
+};
+
+/*! ring of recent spans, written by the thread owning it and read by any thread without lock
+*/
+class mf_trace_ring {
+    /*! ring slot
+    */
+    struct slot {
+        //! odd while writing
+        volatile unsigned seq;
+
+        //! span
+        mf_span span;
+    };
+
+    //! slots
+    std::vector<slot> slots_;
+
+    //! spans committed
+    volatile unsigned long head_;
+
+    //! span of current request
+    mf_span current_;
+
+    //! span slower than it is dumped, 0 for never
+    int threshold_us_;
+
+    //! dump output
+    FILE *out_;
+
+  public:
+
+    /*! ctor
+    \param size   spans kept, less than 1 for 1
+    \param threshold_ms   span slower than it is dumped when done, 0 for never
+    \param out   dump output
+    */
+    explicit mf_trace_ring(size_t size = 1024, int threshold_ms = 0, FILE *out = stderr);
+
+    //! start span of new request
+    mf_span *begin();
+
+    //! finish current span and keep it in ring
+    void commit();
+
+    /*! print span
+    \param span   span
+    \param out   output
+    */
+    static void print(const mf_span &span, FILE *out);
+
+    /*! print recent spans, oldest first, safe from any thread
+    \param out   output
+    \return  spans printed
+    */
+    size_t dump(FILE *out) const;
+};
+
+#endif //__MF_TRACE_H__
@@ -11,6 +11,23 @@
 #include <string.h>//for memset
 #include <stdio.h>//for vsnprintf
 #include <errno.h>//for errno
+#include <sched.h>//for sched_setaffinity
+#include <unistd.h>//for syscall
+#include <sys/syscall.h>//for SYS_set_mempolicy
+#include <sys/socket.h>//for getsockopt,sendmsg
+#include <sys/uio.h>//for writev
+#include <sys/sendfile.h>//for sendfile
+#include <stdlib.h>//for mkstemp
+#include <fcntl.h>//for fcntl
+#include <time.h>//for clock_gettime
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4
+#endif
 
 //#include <ComLogger.h>
 
@@ -18,8 +35,11 @@
 namespace {
 
 enum {
-    WRITER_BUF_SIZE = 0xFFF8,/*!< default writer buffer size . */
-    READER_BUF_SIZE = 8192,/*!< default read buffer size . */
+    QUEUE_CHUNK_SIZE = 0x10000,/*!< max size of output queue chunk . */
+    QUEUE_IOV_COUNT = 16,/*!< max chunks sent by one syscall . */
+    ARENA_BLOCK_SIZE = 4096,/*!< default arena block size . */
+    PARAMS_BATCH_SIZE = 32,/*!< params decoded before appending to index . */
+    LIMITER_PROBE_COUNT = 8,/*!< slots probed for a client . */
 };
 
 //! to int len
@@ -90,21 +110,38 @@ int read_data_(mf_context *ctx, void *vbuf, int len) {
     return readed;
 }
 
-//! write data by timeout
-int write_data_(mf_context *ctx, const void *vbuf, int len) {
-    const char *buf = reinterpret_cast<const char *>(vbuf);
+//! write iovec data by timeout, more for MSG_MORE(kernel holds partial segment)
+int write_iov_(mf_context *ctx, struct iovec *iov, int count, bool more) {
+    const int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
     int writed = 0;
 
-    while (len > 0) {
+    while (count > 0) {
         int ret = is_fd_ready_(ctx, POLLOUT);
 
         if (ret == MF_OK) {
-            ret = ::write(ctx->fd, buf, len);
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ret = to_int_(::sendmsg(ctx->fd, &msg, flags));
+
+            if (ret < 0 && errno == ENOTSOCK) { //pipe or file
+                ret = to_int_(::writev(ctx->fd, iov, count));
+            }
 
             if (ret > 0) {
                 writed += ret;
-                buf += ret;
-                len -= ret;
+
+                while (count > 0 && static_cast<size_t>(ret) >= iov->iov_len) {
+                    ret -= to_int_(iov->iov_len);
+                    ++iov;
+                    --count;
+                }
+
+                if (count > 0) {
+                    iov->iov_base = reinterpret_cast<char *>(iov->iov_base) + ret;
+                    iov->iov_len -= ret;
+                }
             } else {
                 writed = MF_WRITE_ERROR;
                 break;
@@ -115,11 +152,30 @@ int write_data_(mf_context *ctx, const void *vbuf, int len) {
         }
     }
 
-    //WRITE_LOG(LOG_DEBUG, "write data %d %d", len, writed);
+    //WRITE_LOG(LOG_DEBUG, "write data %d %d", count, writed);
 
     return writed;
 }
 
+//! send iovec data without blocking, 0 for would block
+int send_iov_nonblock_(int fd, struct iovec *iov, int count, bool more) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    int ret = to_int_(::sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0)));
+
+    if (ret < 0 && errno == ENOTSOCK) { //pipe or file
+        ret = to_int_(::writev(fd, iov, count));
+    }
+
+    if (ret < 0) {
+        ret = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : MF_WRITE_ERROR;
+    }
+
+    return ret;
+}
+
 //! make fastcgi header
 void set_header_(void *hd, int type, int id, int content_len, int padding_len) {
     assert(content_len >= 0 && content_len <= FCGI_MAX_LENGTH);
@@ -157,7 +213,7 @@ int get_length_(const FCGI_Header &header) {
 }
 
 //! read record body with header info
-int read_record_body_(mf_context *ctx, const FCGI_Header &header, mfbuf_t &buf) {
+int read_record_body_(mf_context *ctx, const FCGI_Header &header, mfbuf_t &buf, int reserve_len) {
     int ret = 0;
 
     if (get_request_id_(header) == ctx->request_id) {
@@ -166,7 +222,7 @@ int read_record_body_(mf_context *ctx, const FCGI_Header &header, mfbuf_t &buf)
 
         if (len > 0) {
             if (buf.capacity() == 0) {
-                buf.reserve(READER_BUF_SIZE);
+                buf.reserve(reserve_len);
             }
 
             const size_t prev_size = buf.size();
@@ -185,9 +241,10 @@ int read_record_body_(mf_context *ctx, const FCGI_Header &header, mfbuf_t &buf)
 }
 
 //! read request by timeout
-int read_record_(mf_context *ctx, int type, mfbuf_t &data) {
+int read_record_(mf_context *ctx, int type, mfbuf_t &data, int reserve_len, mf_stream_sink *sink = NULL, int *sink_status = NULL) {
     int total_len = 0;
     int ret = 0;
+    int sink_ret = MF_OK;
 
     while (true) {
         FCGI_Header  header;
@@ -208,84 +265,193 @@ int read_record_(mf_context *ctx, int type, mfbuf_t &data) {
 
         total_len += FCGI_HEADER_LEN;
 
-        ret = read_record_body_(ctx, header, data);
+        ret = read_record_body_(ctx, header, data, reserve_len);
 
         if (ret > 0) {
             total_len += ret;
         } else {
             break;
         }
-    }
 
-    return (ret == 0 ? total_len : ret);
-}
-
-
-//! parse param length
-int parse_params_len_(const char *&pos, const char *end) {
-    const unsigned char *upos = reinterpret_cast<const unsigned char *>(pos);
-    const unsigned char *uend = reinterpret_cast<const unsigned char *>(end);
-    const unsigned char *ptr = upos;
-    int len = *ptr++;
+        if (sink && !data.empty()) { //hand record content to sink, buffer is reused
+            if (sink_ret >= 0) {
+                sink_ret = sink->on_data(ctx, &data[0], to_int_(data.size()));
+            }
 
-    if ((len & 0x80) != 0) {
-        if (uend - ptr < 3) {
-            return -1;
+            data.clear(); //drain the rest after sink error, so request can still be answered
         }
+    }
 
-        len = ((len & 0x7f) << 24) + (ptr[0] << 16) + (ptr[1] << 8) + ptr[2];
-        ptr += 3;
+    if (sink && ret == 0 && sink_ret >= 0) {
+        sink_ret = sink->on_data(ctx, NULL, 0);
     }
 
-    if (ptr > uend) {
-        return -1;
+    if (sink_ret < 0 && sink_status && *sink_status >= 0) {
+        *sink_status = sink_ret;
     }
 
-    pos += ptr - upos;
+    return (ret == 0 ? total_len : ret);
+}
+
 
-    return len;
+//! read 4 bytes param length
+size_t params_len4_(const unsigned char *pos) {
+    return (static_cast<size_t>(pos[0] & 0x7f) << 24) + (pos[1] << 16) + (pos[2] << 8) + pos[3];
 }
 
-//! parse params from buffer
-int parse_params_(const mfbuf_t &buf, kvmap_t &kvs) {
-    const char *pos = &buf.front();
-    const char *end = pos + buf.size();
+//! parse params from buffer in one pass, all lengths are checked against buffer end
+int parse_params_(const mfbuf_t &buf, mf_params_t &index) {
+    const unsigned char *pos = reinterpret_cast<const unsigned char *>(&buf.front());
+    const unsigned char *end = pos + buf.size();
+
+    //fill a local batch, vector end pointer would be reloaded after each store through char aliasing
+    mf_param batch[PARAMS_BATCH_SIZE];
+    int count = 0;
 
     while (pos < end) {
-        int name_len = parse_params_len_(pos, end);
+        size_t name_len = pos[0];
+        size_t value_len = 0;
 
-        if (name_len < 0) {
-            return MF_PARAMS_ERROR;
-        }
+        if (end - pos >= 2 && (pos[0] | pos[1]) < 0x80) { //both lengths in 1 byte, the common case
+            value_len = pos[1];
+            pos += 2;
+        } else {
+            if ((name_len & 0x80) != 0) {
+                if (end - pos < 4) {
+                    return MF_PARAMS_ERROR;
+                }
 
-        int value_len = parse_params_len_(pos, end);
+                name_len = params_len4_(pos);
+                pos += 4;
+            } else {
+                ++pos;
+            }
+
+            if (pos >= end) {
+                return MF_PARAMS_ERROR;
+            } else if ((*pos & 0x80) != 0) {
+                if (end - pos < 4) {
+                    return MF_PARAMS_ERROR;
+                }
+
+                value_len = params_len4_(pos);
+                pos += 4;
+            } else {
+                value_len = *pos++;
+            }
+        }
 
-        if (value_len < 0) {
+        //each length < 2^31, the sum can't overflow
+        if (name_len + value_len > static_cast<size_t>(end - pos)) {
             return MF_PARAMS_ERROR;
         }
 
-        const char *name_end = pos + name_len;
-        const char *value_end = name_end + value_len;
+        if (name_len != 0) {
+            mf_param &param = batch[count++];
+            param.name.data = reinterpret_cast<const char *>(pos);
+            param.name.len = to_int_(name_len);
+            param.value.data = param.name.data + name_len;
+            param.value.len = to_int_(value_len);
 
-        if (value_end <= end) {
-            const std::string key(pos, name_end);
-            const std::string value(name_end, value_end);
-            if (!key.empty() && !value.empty()){
-                kvs.insert(std::make_pair(key, value));
-            }            
-            pos = value_end;
-        } else {
-            return MF_PARAMS_ERROR;
+            if (count == PARAMS_BATCH_SIZE) {
+                index.insert(index.end(), batch, batch + count);
+                count = 0;
+            }
         }
+
+        pos += name_len + value_len;
     }
 
+    index.insert(index.end(), batch, batch + count);
+
     return MF_OK;
 }
 
+//! find param by name
+mf_strview find_param_(const mf_params_t &params, const char *name) {
+    const int len = to_int_(strlen(name));
+
+    for (mf_params_t::const_iterator itr = params.begin(), end = params.end(); itr != end; ++itr) {
+        if (itr->name.len == len && memcmp(itr->name.data, name, len) == 0) {
+            return itr->value;
+        }
+    }
+
+    mf_strview none = {NULL, 0};
+    return none;
+}
+
+//! hex digit value, -1 for bad digit
+int hex_value_(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+//! time bits of rate limiter slot state
+const uint64_t LIMITER_TIME_MASK = 0xFFFFFFFFFFULL;
+
+/*! milli tokens of rate limiter slot state at now
+\param state   slot state, 0 for new bucket
+\param now   time in millisecond
+\param rate   milli tokens per millisecond
+\param burst   bucket size in milli tokens
+\param last   refill time to store with the tokens
+\return  milli tokens
+*/
+uint64_t limiter_tokens_(uint64_t state, uint64_t now, double rate, uint64_t burst, uint64_t *last) {
+    *last = now;
+
+    if (state == 0) {
+        return burst;
+    }
+
+    const uint64_t tokens = state >> 40;
+    const uint64_t prev = state & LIMITER_TIME_MASK;
+    const uint64_t refill = (now > prev ? static_cast<uint64_t>((now - prev) * rate) : 0);
+
+    if (refill == 0) { //keep time until a whole milli token is refilled, or slow rate never refills
+        *last = prev;
+        return tokens;
+    }
+
+    return (refill >= burst - tokens ? burst : tokens + refill);
+}
+
+//! answer for rejected request
+const char TOO_MANY_REQUESTS[] = "Status: 429 Too Many Requests\r\nRetry-After: 1\r\nContent-type: text/plain\r\n\r\nToo Many Requests";
+
+//! drop streamed records
+struct discard_sink : public mf_stream_sink {
+    virtual int on_data(mf_context *, const char *, int) {
+        return MF_OK;
+    }
+};
+
+//! string view equals c string
+bool equals_(const mf_strview &view, const char *str) {
+    const int len = to_int_(strlen(str));
+    return view.len == len && memcmp(view.data, str, len) == 0;
+}
+
 //! make aligned int 8 bytes
 int align_int8_(int n) {
     return (n + 7) & 0xFFFFFFF8;
 }
+
+//! prefer memory of local numa node for calling thread
+void bind_local_memory_() {
+#ifdef SYS_set_mempolicy
+    //fails with ENOSYS on kernels without numa, first touch is local anyway
+    syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+#endif
+}
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -295,6 +461,8 @@ void mf_context::reset(int fd, int timeout_ms) {
     write_type = FCGI_STDOUT;
     app_status = MF_OK;
     protocol_status = FCGI_REQUEST_COMPLETE;
+    role = 0;
+    span = NULL;
 
     gettimeofday(&timeout_pt, NULL);
     timeout_pt.tv_sec += timeout_ms / 1000;
@@ -308,36 +476,116 @@ int mf_context::timeout_ms() const {
 }
 
 //////////////////////////////////////////////////////////////////////////
-int mf_reader::read_record_body(mf_context *ctx) {
-    params_buf_.clear();
-    return read_record_body_(ctx, ctx->header, params_buf_);
+char *mf_arena::alloc(size_t len) {
+    if (blocks_.empty() || used_ + len > blocks_.back().size()) {
+        blocks_.push_back(mfbuf_t());
+        blocks_.back().resize(len > static_cast<size_t>(ARENA_BLOCK_SIZE) ? len : static_cast<size_t>(ARENA_BLOCK_SIZE));
+        used_ = 0;
+    }
+
+    char *ret = &blocks_.back()[used_];
+    used_ += len;
+
+    return ret;
 }
 
-int mf_reader::read_record_params(mf_context *ctx) {
-    request_params_.clear();
-    params_buf_.clear();
+void mf_arena::reset() {
+    if (blocks_.size() > 1) {
+        blocks_.resize(1);
+    }
 
-    int len = read_record_body_(ctx, ctx->header, params_buf_);
+    used_ = 0;
+}
 
-    if (len > 0) {
-        int ret = parse_params_(params_buf_, request_params_);
+uint64_t mf_hash(const char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL; //fnv-1a 64
 
-        if (ret < 0) {
-            return ret;
+    for (const char *end = data + len; data != end; ++data) {
+        hash ^= static_cast<unsigned char>(*data);
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+void mf_split_args(const char *data, int len, char sep, bool cookie, mf_params_t &args) {
+    const char *pos = data;
+    const char *end = pos + len;
+
+    while (pos < end) {
+        const char *item_end = reinterpret_cast<const char *>(memchr(pos, sep, end - pos));
+
+        if (item_end == NULL) {
+            item_end = end;
+        }
+
+        while (cookie && pos < item_end && *pos == ' ') { //cookies are separated by "; "
+            ++pos;
+        }
+
+        if (pos < item_end) {
+            const char *eq = reinterpret_cast<const char *>(memchr(pos, '=', item_end - pos));
+            const char *value = (eq ? eq + 1 : item_end);
+            mf_param arg;
+            arg.name.data = pos;
+            arg.name.len = to_int_((eq ? eq : item_end) - pos);
+            arg.value.data = value;
+            arg.value.len = to_int_(item_end - value);
+
+            if (cookie && arg.value.len >= 2 && value[0] == '"' && item_end[-1] == '"') { //quoted cookie
+                ++arg.value.data;
+                arg.value.len -= 2;
+            }
+
+            args.push_back(arg);
         }
+
+        pos = item_end + 1;
     }
+}
 
-    return len;
+int64_t mf_now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
 }
 
-int mf_reader::read_params(mf_context *ctx) {
-    request_params_.clear();
-    params_buf_.clear();
+int mf_url_decode(const char *src, int len, char *dst, bool plus) {
+    const char *end = src + len;
+    char *out = dst;
 
-    int len = read_record_(ctx, FCGI_PARAMS, params_buf_);
+    while (src < end) {
+        int hi = 0;
+        int lo = 0;
 
+        if (*src == '%' && end - src >= 3 && (hi = hex_value_(src[1])) >= 0 && (lo = hex_value_(src[2])) >= 0) {
+            *out++ = static_cast<char>((hi << 4) + lo);
+            src += 3;
+        } else if (*src == '+' && plus) {
+            *out++ = ' ';
+            ++src;
+        } else {
+            *out++ = *src++;
+        }
+    }
+
+    return to_int_(out - dst);
+}
+
+//////////////////////////////////////////////////////////////////////////
+mf_reader::mf_reader(int buf_size, bool materialize)
+    : route_handler_(NULL), routed_(false), sink_status_(MF_OK), query_parsed_(false), cookies_parsed_(false), buf_size_(buf_size), materialize_(materialize) {
+}
+
+void mf_reader::reallocate() {
+    mfbuf_t().swap(params_buf_);
+    mfbuf_t().swap(request_stdin_);
+    mfbuf_t().swap(request_data_);
+}
+
+int mf_reader::parse_params(int len) {
     if (len > 0) {
-        int ret = parse_params_(params_buf_, request_params_);
+        int ret = parse_params_(params_buf_, params_index_);
 
         if (ret < 0) {
             return ret;
@@ -347,18 +595,331 @@ int mf_reader::read_params(mf_context *ctx) {
     return len;
 }
 
+void mf_reader::materialize_params() {
+    if (materialize_ && request_params_.empty()) {
+        for (mf_params_t::const_iterator itr = params_index_.begin(), end = params_index_.end(); itr != end; ++itr) {
+            if (!itr->value.empty()) {
+                request_params_.insert(std::make_pair(itr->name.str(), itr->value.str()));
+            }
+        }
+    }
+}
+
+mf_strview mf_reader::param(const char *name) const {
+    return find_param_(params_index_, name);
+}
+
+mf_strview mf_reader::route_arg(const char *name) const {
+    return find_param_(route_args_, name);
+}
+
+mf_strview mf_reader::decode_arg_(const mf_params_t &args, std::vector<mf_strview> &values, const char *name, bool plus) {
+    const int len = to_int_(strlen(name));
+
+    for (size_t i = 0, size = args.size(); i != size; ++i) {
+        const mf_param &arg = args[i];
+
+        if (arg.name.len == len && memcmp(arg.name.data, name, len) == 0) {
+            mf_strview &value = values[i];
+
+            if (value.data == NULL) {
+                value = arg.value;
+
+                if (memchr(value.data, '%', value.len) != NULL || (plus && memchr(value.data, '+', value.len) != NULL)) {
+                    char *buf = arena_.alloc(value.len);
+                    value.len = mf_url_decode(value.data, value.len, buf, plus);
+                    value.data = buf;
+                }
+            }
+
+            return value;
+        }
+    }
+
+    mf_strview none = {NULL, 0};
+    return none;
+}
+
+const mf_params_t &mf_reader::query_args() {
+    if (!query_parsed_) {
+        query_parsed_ = true;
+        const mf_strview query = param("QUERY_STRING");
+        mf_split_args(query.data, query.len, '&', false, query_args_);
+        mf_strview none = {NULL, 0};
+        query_values_.assign(query_args_.size(), none);
+    }
+
+    return query_args_;
+}
+
+mf_strview mf_reader::query_arg(const char *name) {
+    return decode_arg_(query_args(), query_values_, name, true);
+}
+
+const mf_params_t &mf_reader::cookies() {
+    if (!cookies_parsed_) {
+        cookies_parsed_ = true;
+        const mf_strview cookie = param("HTTP_COOKIE");
+        mf_split_args(cookie.data, cookie.len, ';', true, cookies_);
+        mf_strview none = {NULL, 0};
+        cookie_values_.assign(cookies_.size(), none);
+    }
+
+    return cookies_;
+}
+
+mf_strview mf_reader::cookie(const char *name) {
+    return decode_arg_(cookies(), cookie_values_, name, false);
+}
+
+int mf_reader::read_header(mf_context *ctx) {
+    int ret = read_data_(ctx, &ctx->header, FCGI_HEADER_LEN);
+
+    if (ret == FCGI_HEADER_LEN) {
+        ctx->request_id = get_request_id_(ctx->header);
+        //WRITE_LOG(LOG_DEBUG, "type %d, id %d", ctx->header.type, ctx->request_id);
+    }
+
+    return ret;
+}
+
+int mf_reader::read_begin_request(mf_context *ctx) {
+    FCGI_BeginRequestBody body;
+    int ret = read_data_(ctx, &body, to_int_(sizeof(body)));
+
+    if (ret > 0) {
+        ctx->role = (body.roleB1 << 8) + body.roleB0;
+        ctx->flags = body.flags;
+    }
+
+    return ret;
+}
+
+int mf_reader::read_record_body(mf_context *ctx) {
+    params_buf_.clear();
+    return read_record_body_(ctx, ctx->header, params_buf_, buf_size_);
+}
+
+int mf_reader::read_record_params(mf_context *ctx) {
+    request_params_.clear();
+    params_index_.clear();
+    params_buf_.clear();
+
+    const int ret = parse_params(read_record_body_(ctx, ctx->header, params_buf_, buf_size_));
+    materialize_params();
+
+    return ret;
+}
+
+int mf_reader::read_params(mf_context *ctx) {
+    request_params_.clear();
+    params_index_.clear();
+    route_args_.clear();
+    route_handler_ = NULL;
+    routed_ = false;
+    sink_status_ = MF_OK;
+    query_args_.clear();
+    cookies_.clear();
+    query_parsed_ = cookies_parsed_ = false;
+    arena_.reset();
+    params_buf_.clear();
+
+    return parse_params(read_record_(ctx, FCGI_PARAMS, params_buf_, buf_size_));
+}
+
+int mf_reader::read_stdin(mf_context *ctx, mf_stream_sink *sink) {
+    request_stdin_.clear();
+    return read_record_(ctx, FCGI_STDIN, request_stdin_, buf_size_, sink, &sink_status_);
+}
+
 int mf_reader::read_stdin(mf_context *ctx) {
     request_stdin_.clear();
-    return read_record_(ctx, FCGI_STDIN, request_stdin_);
+    return read_record_(ctx, FCGI_STDIN, request_stdin_, buf_size_);
+}
+
+int mf_reader::read_data(mf_context *ctx, mf_stream_sink *sink) {
+    request_data_.clear();
+    return read_record_(ctx, FCGI_DATA, request_data_, buf_size_, sink, &sink_status_);
+}
+
+int mf_reader::skip_records(mf_context *ctx, int type) {
+    discard_sink sink;
+    mfbuf_t &buf = (type == FCGI_DATA ? request_data_ : request_stdin_);
+    buf.clear();
+    return read_record_(ctx, type, buf, buf_size_, &sink);
 }
 
 int mf_reader::read_data(mf_context *ctx) {
     request_data_.clear();
-    return read_record_(ctx, FCGI_DATA, request_data_);
+    return read_record_(ctx, FCGI_DATA, request_data_, buf_size_);
 }
 //////////////////////////////////////////////////////////////////////////
-mf_writer::mf_writer() {
-    buf_.resize(WRITER_BUF_SIZE);
+mf_outqueue::mf_outqueue(size_t mem_limit, size_t total_limit, const char *spill_dir)
+    : head_sent_(0), mem_size_(0), spill_fd_(-1), spill_read_(0), spill_write_(0),
+      mem_limit_(mem_limit), total_limit_(total_limit), spill_dir_(spill_dir) {
+}
+
+mf_outqueue::~mf_outqueue() {
+    clear();
+}
+
+void mf_outqueue::clear() {
+    chunks_.clear();
+    head_sent_ = 0;
+    mem_size_ = 0;
+
+    if (spill_fd_ >= 0) {
+        close(spill_fd_);
+        spill_fd_ = -1;
+    }
+
+    spill_read_ = spill_write_ = 0;
+}
+
+int mf_outqueue::push_(const char *data, size_t len) {
+    if (size() + len > total_limit_) {
+        return MF_WRITE_ERROR;
+    }
+
+    //keep order, once spilled all data goes to file until it is drained
+    if (spill_write_ == spill_read_ && mem_size_ + len <= mem_limit_) {
+        if (chunks_.empty() || chunks_.back().size() + len > QUEUE_CHUNK_SIZE) {
+            chunks_.push_back(mfbuf_t());
+            chunks_.back().reserve(len > static_cast<size_t>(QUEUE_CHUNK_SIZE) ? len : static_cast<size_t>(QUEUE_CHUNK_SIZE));
+        }
+
+        mfbuf_t &chunk = chunks_.back();
+        chunk.insert(chunk.end(), data, data + len);
+        mem_size_ += len;
+        return MF_OK;
+    }
+
+    if (spill_fd_ < 0 && (spill_fd_ = mf_mktemp(spill_dir_.c_str())) < 0) {
+        return MF_WRITE_ERROR;
+    }
+
+    while (len > 0) {
+        const ssize_t ret = ::pwrite(spill_fd_, data, len, spill_write_);
+
+        if (ret > 0) {
+            data += ret;
+            len -= ret;
+            spill_write_ += ret;
+        } else if (ret < 0 && errno != EINTR) {
+            return MF_WRITE_ERROR;
+        }
+    }
+
+    return MF_OK;
+}
+
+int mf_outqueue::write(int fd, const struct iovec *iov, int count, bool more) {
+    int total_len = 0;
+
+    for (int i = 0; i != count; ++i) {
+        total_len += to_int_(iov[i].iov_len);
+    }
+
+    int sent = 0;
+
+    if (empty()) {
+        struct iovec tmp[2]; //writer sends chunk and tail at most
+        assert(count <= 2);
+        memcpy(tmp, iov, sizeof(tmp[0]) * count);
+
+        if ((sent = send_iov_nonblock_(fd, tmp, count, more)) < 0) {
+            return sent;
+        }
+    }
+
+    for (int i = 0; i != count; ++i) {
+        const int len = to_int_(iov[i].iov_len);
+
+        if (sent >= len) {
+            sent -= len;
+            continue;
+        }
+
+        const int ret = push_(reinterpret_cast<const char *>(iov[i].iov_base) + sent, len - sent);
+
+        if (ret < 0) {
+            return ret;
+        }
+
+        sent = 0;
+    }
+
+    return total_len;
+}
+
+int mf_outqueue::drain(int fd) {
+    while (!chunks_.empty()) {
+        struct iovec iov[QUEUE_IOV_COUNT];
+        int count = 0;
+
+        for (std::deque<mfbuf_t>::iterator itr = chunks_.begin(), end = chunks_.end(); itr != end && count != QUEUE_IOV_COUNT; ++itr, ++count) {
+            const size_t offset = (count == 0 ? head_sent_ : 0);
+            iov[count].iov_base = &(*itr)[offset];
+            iov[count].iov_len = itr->size() - offset;
+        }
+
+        int ret = send_iov_nonblock_(fd, iov, count, spill_write_ != spill_read_);
+
+        if (ret <= 0) {
+            return ret < 0 ? ret : to_int_(size());
+        }
+
+        mem_size_ -= ret;
+
+        while (ret > 0) {
+            const int left = to_int_(chunks_.front().size() - head_sent_);
+
+            if (ret >= left) {
+                ret -= left;
+                chunks_.pop_front();
+                head_sent_ = 0;
+            } else {
+                head_sent_ += ret;
+                ret = 0;
+            }
+        }
+    }
+
+    if (spill_read_ != spill_write_) { //sendfile has no MSG_DONTWAIT
+        const int flags = fcntl(fd, F_GETFL);
+
+        if (flags < 0 || ((flags & O_NONBLOCK) == 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+            return MF_WRITE_ERROR;
+        }
+    }
+
+    while (spill_read_ != spill_write_) {
+        const ssize_t ret = ::sendfile(fd, spill_fd_, &spill_read_, spill_write_ - spill_read_);
+
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return MF_WRITE_ERROR;
+        } else if (ret <= 0) {
+            return to_int_(size());
+        }
+    }
+
+    if (spill_fd_ >= 0) { //drained, later backlog uses memory again
+        close(spill_fd_);
+        spill_fd_ = -1;
+        spill_read_ = spill_write_ = 0;
+    }
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+mf_writer::mf_writer(int buf_size): cork_(true), queue_(NULL) {
+    assert(buf_size % 8 == 0 && buf_size <= FCGI_HEADER_LEN + FCGI_MAX_LENGTH);
+    buf_.resize(buf_size);
+}
+
+void mf_writer::reallocate() {
+    mfbuf_t(buf_.size()).swap(buf_);
 }
 
 int mf_writer::write_record(mf_context *ctx, write_tag tag, const void *data, int len, const char *format, ...) {
@@ -398,7 +959,8 @@ int mf_writer::write_record(mf_context *ctx, write_tag tag, const void *data, in
     }
 
     const char *cdata = reinterpret_cast<const char *>(data);
-    bool write_tail = (tag != NIL);
+    const int record_len = to_int_(sizeof(FCGI_EndRequestRecord));
+    char tail[FCGI_HEADER_LEN + sizeof(FCGI_EndRequestRecord)];
 
     do {
         left_len = buf_len - used_len;
@@ -414,81 +976,105 @@ int mf_writer::write_record(mf_context *ctx, write_tag tag, const void *data, in
         const int content_len = used_len - FCGI_HEADER_LEN;
         const int padding_len = align_int8_(content_len) - content_len;
         set_header_(&buf_[0], ctx->write_type, ctx->request_id, content_len, padding_len);
-        int raw_len = used_len + padding_len;
-
-        if (buf_len > raw_len && write_tail) {
-            const int left_raw_len = buf_len - raw_len;
-            const int record_len = to_int_(sizeof(FCGI_EndRequestRecord));
-            const bool has_content = (content_len != 0);
-            const int tail_len = (tag == FINISHED ? record_len : 0) + (has_content ? FCGI_HEADER_LEN : 0);
-
-            if (tail_len <= left_raw_len) {
-                if (has_content) { //avoid writing one more empty headers
-                    set_header_(&buf_[raw_len], ctx->write_type, ctx->request_id, 0, 0);
-                    raw_len += FCGI_HEADER_LEN;
-                }
+        const int raw_len = used_len + padding_len;
+        int tail_len = 0;
 
-                if (tag == FINISHED) {
-                    set_end_request_(&buf_[raw_len], ctx->request_id, ctx->app_status, ctx->protocol_status);
-                    raw_len += record_len;
-                }
+        if (len == 0 && tag != NIL) { //tail goes out with the last chunk in one syscall
+            if (content_len != 0) { //avoid writing one more empty headers
+                set_header_(&tail[tail_len], ctx->write_type, ctx->request_id, 0, 0);
+                tail_len += FCGI_HEADER_LEN;
+            }
 
-                write_tail = false;
+            if (tag == FINISHED) {
+                set_end_request_(&tail[tail_len], ctx->request_id, ctx->app_status, ctx->protocol_status);
+                tail_len += record_len;
             }
         }
 
-        int ret = write_data_(ctx, &buf_[0], raw_len);
+        struct iovec iov[2];
+        iov[0].iov_base = &buf_[0];
+        iov[0].iov_len = raw_len;
+        iov[1].iov_base = tail;
+        iov[1].iov_len = tail_len;
+
+        //hold partial segments until the request is finished
+        const bool more = (len > 0 || (cork_ && tag != FINISHED));
+        const int64_t start_us = (ctx->span ? mf_trace_now_us() : 0);
+        int ret = (queue_ ? queue_->write(ctx->fd, iov, tail_len > 0 ? 2 : 1, more) : write_iov_(ctx, iov, tail_len > 0 ? 2 : 1, more));
+        MF_TRACE_PROBE2(write, ctx->request_id, ret);
+
+        if (ctx->span) {
+            ctx->span->write_us += static_cast<int>(mf_trace_now_us() - start_us);
+            ctx->span->bytes_out += (ret > 0 ? ret : 0);
+        }
 
-        if (ret != raw_len) {
+        if (ret != raw_len + tail_len) {
             return ret;
         }
 
-        total_len += raw_len;
+        total_len += ret;
         used_len = FCGI_HEADER_LEN;
-    } while (len > 0 || write_tail);
+    } while (len > 0);
 
     return total_len;
 }
+int mf_writer::write_unknown_type(mf_context *ctx) {
+    ctx->write_type = FCGI_UNKNOWN_TYPE;
+    FCGI_UnknownTypeBody body;
+    body.type = ctx->header.type;
+    memset(body.reserved, 0, sizeof(body.reserved));
+    return write_finished_record(ctx, &body, to_int_(sizeof(body)));
+}
 //////////////////////////////////////////////////////////////////////////
-int mf_handler::on_auth(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+int mf_handler_base::on_auth(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
     ctx->app_status = MF_UNSUPPORTED_AUTH;
     return writer->write_finished_record(ctx);
 }
 
-int mf_handler::on_filter(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+int mf_handler_base::on_filter(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
     ctx->app_status = MF_UNSUPPORTED_FILTER;
     return writer->write_finished_record(ctx);
 }
 
-int mf_handler::on_multiconnect(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+int mf_handler_base::on_multiconnect(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
     ctx->protocol_status = FCGI_CANT_MPX_CONN;
     return writer->write_finished_record(ctx);
 }
 
-int mf_handler::on_management(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+int mf_handler_base::on_management(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
     assert(ctx->header.type == FCGI_GET_VALUES);
     int ret = reader->read_record_params(ctx);
 
     if (ret > 0) {
         char buf[64]; /* 64 = 8 + 3*(1+1+14+1)* + padding */
         char *buf_end = &buf[0];
-        const kvmap_t &params = reader->request_params();
+        const mf_params_t &params = reader->params();
+        int answered = 0; //each variable at most once, names may repeat in the index
 
-        for (kvmap_t::const_iterator itr = params.begin(), end = params.end(); itr != end; ++itr) {
+        for (mf_params_t::const_iterator itr = params.begin(), end = params.end(); itr != end; ++itr) {
             char value = '\0';
+            int bit = 0;
 
-            if (itr->first == FCGI_MAX_CONNS) {
+            if (equals_(itr->name, FCGI_MAX_CONNS)) {
                 value = '1';
-            } else if (itr->first == FCGI_MAX_REQS) {
+                bit = 1;
+            } else if (equals_(itr->name, FCGI_MAX_REQS)) {
                 value = '1';
-            } else if (itr->first == FCGI_MPXS_CONNS) {
+                bit = 2;
+            } else if (equals_(itr->name, FCGI_MPXS_CONNS)) {
                 value = '0';
+                bit = 4;
             }
 
-            if (value != '\0') {
-                int len = itr->first.length();
-                sprintf(buf_end, "%c%c%s%c", len, 1, itr->first.c_str(), value);
-                buf_end += len + 3;
+            const int len = itr->name.len;
+
+            if (value != '\0' && (answered & bit) == 0 && buf_end + len + 3 <= buf + sizeof(buf)) {
+                answered |= bit;
+                *buf_end++ = static_cast<char>(len);
+                *buf_end++ = 1;
+                memcpy(buf_end, itr->name.data, len);
+                buf_end += len;
+                *buf_end++ = value;
             }
         }
 
@@ -499,91 +1085,157 @@ int mf_handler::on_management(mf_context *ctx, mf_reader *reader, mf_writer *wri
     return ret;
 }
 
-//////////////////////////////////////////////////////////////////////////
-int mtfcgi::handle(int fd, int timeout_ms, mf_handler *handler) {
-    ctx.reset(fd, timeout_ms);
+mf_stream_sink *mf_handler::stdin_sink(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    return mf_handler_base::stdin_sink(ctx, reader, writer);
+}
 
-    while (true) {
-        if ((ctx.app_status = read_data_(&ctx, &ctx.header, FCGI_HEADER_LEN)) != FCGI_HEADER_LEN) {
-            break;
-        }
+mf_stream_sink *mf_handler::data_sink(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    return mf_handler_base::data_sink(ctx, reader, writer);
+}
 
-        ctx.request_id = get_request_id_(ctx.header);
-        //WRITE_LOG(LOG_DEBUG, "type %d, id %d", ctx.header.type, ctx.request_id);
+int mf_handler::on_auth(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    return mf_handler_base::on_auth(ctx, reader, writer);
+}
 
-        if (ctx.header.type == FCGI_BEGIN_REQUEST) {//handle app reqeust
-            //check id!=0
-            if (ctx.request_id == FCGI_NULL_REQUEST_ID) {
-                ctx.app_status = MF_REQUSET_ID_ERROR;
-                break;
-            }
+int mf_handler::on_filter(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    return mf_handler_base::on_filter(ctx, reader, writer);
+}
 
-            //read body info
-            FCGI_BeginRequestBody body;
-            const int body_len = to_int_(sizeof(body));
+int mf_handler::on_multiconnect(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    return mf_handler_base::on_multiconnect(ctx, reader, writer);
+}
 
-            if ((ctx.app_status = read_data_(&ctx, &body, body_len)) != body_len) {
-                break;
-            }
+int mf_handler::on_management(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    return mf_handler_base::on_management(ctx, reader, writer);
+}
 
-            ctx.role = (body.roleB1 << 8) + body.roleB0;
-            ctx.flags = body.flags;
+//////////////////////////////////////////////////////////////////////////
+mf_rate_limiter::mf_rate_limiter(double rate, int burst, const char *key_param, size_t capacity, size_t shard_count)
+    : shard_count_(shard_count), shard_size_(capacity / shard_count), rate_(rate), burst_(static_cast<uint64_t>(burst) * 1000), key_param_(key_param) {
+    assert(burst > 0 && burst_ < (1 << 24) && shard_size_ >= LIMITER_PROBE_COUNT);
+    slots_ = new slot[shard_count_ * shard_size_];
+    memset(const_cast<slot *>(slots_), 0, sizeof(slot) * shard_count_ * shard_size_);
+    start_ms_ = mf_now_ms();
+}
 
-            // read params info
-            if ((ctx.app_status = reader.read_params(&ctx)) < 0) {
-                break;
+mf_rate_limiter::~mf_rate_limiter() {
+    delete[] slots_;
+}
+
+bool mf_rate_limiter::allow(const char *key, int len) {
+    const uint64_t raw = mf_hash(key, len);
+    const uint64_t hash = raw | 1; //never 0(free slot)
+    slot *shard = slots_ + (raw % shard_count_) * shard_size_;
+    const size_t first = static_cast<size_t>(raw >> 32) % shard_size_;
+    const uint64_t now = (static_cast<uint64_t>(mf_now_ms() - start_ms_) + 1) & LIMITER_TIME_MASK; //0 is new bucket
+    uint64_t last = 0;
+    slot *bucket = NULL;
+    slot *fullest = NULL;
+    uint64_t fullest_owner = 0;
+    uint64_t fullest_tokens = 0;
+
+    for (size_t i = 0; i != LIMITER_PROBE_COUNT && bucket == NULL; ++i) {
+        slot *cur = shard + (first + i) % shard_size_;
+        const uint64_t owner = cur->key;
+
+        if (owner == hash || (owner == 0 && (__sync_val_compare_and_swap(&cur->key, 0, hash) == 0 || cur->key == hash))) {
+            bucket = cur;
+        } else if (owner != 0) {
+            const uint64_t tokens = limiter_tokens_(cur->state, now, rate_, burst_, &last);
+
+            if (fullest == NULL || tokens > fullest_tokens) {
+                fullest = cur;
+                fullest_owner = owner;
+                fullest_tokens = tokens;
             }
+        }
+    }
 
-            switch (ctx.role) {//handle role request
-                case FCGI_RESPONDER:
-                    if ((ctx.app_status = reader.read_stdin(&ctx)) > 0) {
-                        ctx.app_status = handler->on_response(&ctx, &reader, &writer);
-                    }
+    if (bucket == NULL) { //table pressure
+        bucket = fullest;
 
-                    break;
+        if (fullest_tokens >= burst_) { //reclaim a fully refilled bucket, its owner loses nothing
+            __sync_bool_compare_and_swap(&bucket->key, fullest_owner, hash);
+        } //else share the fullest bucket, never reset an active client to a full burst
+    }
 
-                case FCGI_AUTHORIZER:
-                    ctx.app_status = handler->on_auth(&ctx, &reader, &writer);
-                    break;
+    while (true) {
+        const uint64_t old_state = bucket->state;
+        uint64_t tokens = limiter_tokens_(old_state, now, rate_, burst_, &last);
+        const bool allowed = (tokens >= 1000);
 
-                case FCGI_FILTER:
-                    if ((ctx.app_status = reader.read_stdin(&ctx)) > 0 && (ctx.app_status = reader.read_data(&ctx)) > 0) {
-                        ctx.app_status = handler->on_filter(&ctx, &reader, &writer);
-                    }
+        if (allowed) {
+            tokens -= 1000;
+        }
 
-                    break;
+        if (__sync_bool_compare_and_swap(&bucket->state, old_state, (tokens << 40) | last)) {
+            return allowed;
+        }
+    }
+}
 
-                default://bad role
-                    ctx.protocol_status = FCGI_UNKNOWN_ROLE;
-                    ctx.app_status = writer.write_finished_record(&ctx);
-                    break;
-            }
+bool mf_rate_limiter::allow(const mf_reader &reader) {
+    const mf_strview key = reader.param(key_param_.c_str());
+    return key.data == NULL || allow(key.data, key.len);
+}
 
-            break;
-        } else if (ctx.request_id == FCGI_NULL_REQUEST_ID) {//handle management request
-            if (ctx.header.type == FCGI_GET_VALUES) {
-                ctx.app_status = handler->on_management(&ctx, &reader, &writer);
-            } else {
-                ctx.write_type = FCGI_UNKNOWN_TYPE;
-                FCGI_UnknownTypeBody body;
-                body.type = ctx.header.type;
-                memset(body.reserved, 0, sizeof(body.reserved));
-                ctx.app_status = writer.write_finished_record(&ctx, &body, to_int_(sizeof(body)));
-            }
+int mf_rate_limiter::reject(mf_context *ctx, mf_reader *reader, mf_writer *writer) {
+    if (ctx->role != FCGI_AUTHORIZER) { //keep protocol in step, and no RST from unread data on close
+        int ret = reader->skip_records(ctx, FCGI_STDIN);
 
-            break;
-        } else {//handle ignored request
-            //WRITE_LOG(LOG_DEBUG, "ignored type %d,length %d", ctx.header.type, ctx.app_status);
-            if ((ctx.app_status = reader.read_record_body(&ctx)) < 0) {
-                break;
-            }
+        if (ret >= 0 && ctx->role == FCGI_FILTER) {
+            ret = reader->skip_records(ctx, FCGI_DATA);
+        }
+
+        if (ret < 0) {
+            return ret;
         }
     }
 
-    if (ctx.app_status == MF_UNSUPPORTED_MPX_CONN) {
-        ctx.app_status = handler->on_multiconnect(&ctx, &reader, &writer);
+    return writer->write_finished_record(ctx, TOO_MANY_REQUESTS, to_int_(sizeof(TOO_MANY_REQUESTS) - 1));
+}
+
+//////////////////////////////////////////////////////////////////////////
+int mf_bind_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        return MF_ERROR;
     }
 
-    return ctx.app_status;
+    bind_local_memory_();
+
+    return MF_OK;
 }
 
+//////////////////////////////////////////////////////////////////////////
+int mf_mktemp(const char *dir) {
+    std::string path(dir);
+    path += "/mtfcgi.XXXXXX";
+    int fd = mkstemp(&path[0]);
+
+    if (fd < 0) {
+        return MF_ERROR;
+    }
+
+    unlink(path.c_str());
+
+    return fd;
+}
+
+int mf_get_incoming_cpu(int fd) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0) {
+        return MF_ERROR;
+    }
+
+    return cpu;
+}
+
+int mf_set_incoming_cpu(int fd, int cpu) {
+    return setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == 0 ? MF_OK : MF_ERROR;
+}
@@ -30,7 +30,8 @@ struct my_consumer_data : public mf_handler{
 };
 
 
-static int thread_consumer_run(epoll_class_t* poll,my_consumer_data* consumer){
+static int thread_consumer_run(epoll_class_t* poll,my_consumer_data* consumer,int cpu){
+    consumer->mf.bind_cpu(cpu);//pin thread, buffers come from local numa node
     return consumer->mf.handler(poll->get_fd(),TIMEOUT_MS,consumer);
 }
 
@@ -40,7 +41,7 @@ int main(){
     std::vector<my_consumer_data> consumers(THREAD_COUNT);
 
     for(int i = 0 ; i != THREAD_COUNT; ++ i){
-        threads.add_thread(new boost::thread(thread_consumer_run, &poll, &consumers[i]));
+        threads.add_thread(new boost::thread(thread_consumer_run, &poll, &consumers[i], i));
     }
 
     while(poll.go()){
@@ -52,17 +53,33 @@ int main(){
     return 0;
 }
 
+compile-time configured, handler calls are inlined:
+
+struct my_config : public mf_default_config {
+    enum { writer_buf_size = 0x4000, materialize_params = 0 };
+};
+
+struct my_handler : public mf_handler_base {
+    int on_response(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+};
+
+basic_mtfcgi<my_handler, my_config> mf;
+
 */
 #ifndef __MTFCGI_H__
 #define __MTFCGI_H__
 
 #include "fastcgi.h"//for fastcgi protocol
+#include "mf_trace.h"//for mf_span
 
+#include <deque> // for mf_outqueue
 #include <map> // for kvmap_t
 #include <string> // for std::string
 #include <stdarg.h> // for va_list
 #include <sys/time.h> //for timeval
 #include <vector> // for vector
+#include <sys/uio.h> //for iovec
+#include <stdint.h> //for uint64_t
 
 /*! mtfcgi return code
 */
@@ -83,6 +100,16 @@ enum mf_status {
     MF_UNSUPPORTED_FILTER = -14,/*!<  not support filter role(default,you can change it). */
 };
 
+/*! default compile-time configuration of basic_mtfcgi
+*/
+struct mf_default_config {
+    enum {
+        writer_buf_size = 0xFFF8,/*!< writer buffer size, multiple of 8 and no more than 0xFFF8 . */
+        reader_buf_size = 8192,/*!< initial reader buffer size . */
+        materialize_params = 1,/*!< fill kvmap_t besides params index, 0 for index only . */
+    };
+};
+
 /*! mtfcgi context
 */
 struct mf_context {
@@ -113,6 +140,9 @@ struct mf_context {
     //! FCGI Header
     FCGI_Header header;
 
+    //! span of current request, NULL for not traced
+    mf_span *span;
+
     //! reset content
     void reset(int fd, int timeout_ms);
 
@@ -131,6 +161,110 @@ typedef std::map<std::string, std::string> kvmap_t;
 //! buffer type
 typedef std::vector<char> mfbuf_t;
 
+/*! string view into reader buffer
+*/
+struct mf_strview {
+    //! data, NULL for not found
+    const char *data;
+
+    //! data len
+    int len;
+
+    //! is empty
+    bool empty() const {
+        return len == 0;
+    }
+
+    //! to string
+    std::string str() const {
+        return std::string(data ? data : "", len);
+    }
+};
+
+/*! param name and value in params buffer
+*/
+struct mf_param {
+    //! param name
+    mf_strview name;
+
+    //! param value
+    mf_strview value;
+};
+
+//! params index type
+typedef std::vector<mf_param> mf_params_t;
+
+/*! receiver of record content streamed by mf_reader
+*/
+struct mf_stream_sink {
+    //! dtor
+    virtual ~mf_stream_sink() {
+    }
+
+    /*! called for content of each record
+    \param ctx   mf_context object
+    \param data   content, valid until return; NULL for end of stream
+    \param len   content len; 0 for end of stream
+    \return >=0 for ok; others for error status in mf_status
+    */
+    virtual int on_data(mf_context *ctx, const char *data, int len) = 0;
+};
+
+/*! scratch memory for one request, released all at once by reset()
+*/
+class mf_arena {
+    //! memory blocks, deque keeps address
+    std::deque<mfbuf_t> blocks_;
+
+    //! used bytes of last block
+    size_t used_;
+
+  public:
+
+    //! ctor
+    mf_arena(): used_(0) {
+    }
+
+    /*! allocate memory valid until reset()
+    \param len   bytes
+    \return  memory
+    */
+    char *alloc(size_t len);
+
+    //! release memory, first block is kept for next request
+    void reset();
+};
+
+/*! percent-decode
+\param src   encoded data
+\param len   encoded data len
+\param dst   decoded data, at least len bytes, may be src
+\param plus   decode '+' to space(form encoding)
+\return  decoded len
+*/
+int mf_url_decode(const char *src, int len, char *dst, bool plus);
+
+/*! split "k1=v1&k2=v2" or cookies "k1=v1; k2=\"v2\"" into views, key without '=' has empty value
+\param data   data
+\param len   data len
+\param sep   separator, '&' or ';'
+\param cookie   skip leading spaces and strip quotes of values
+\param args   appended views into data, values are not decoded
+*/
+void mf_split_args(const char *data, int len, char sep, bool cookie, mf_params_t &args);
+
+/*! fnv-1a 64 hash
+\param data   data
+\param len   data len
+\return  hash
+*/
+uint64_t mf_hash(const char *data, size_t len);
+
+//! monotonic time in millisecond, immune to wall clock steps
+int64_t mf_now_ms();
+
+struct mf_handler;
+
 /*! mtfcgi reader
 */
 class mf_reader {
@@ -146,8 +280,74 @@ class mf_reader {
     //! result for parse params_buf_
     kvmap_t request_params_;
 
+    //! index for parse params_buf_
+    mf_params_t params_index_;
+
+    //! path segments captured by router
+    mf_params_t route_args_;
+
+    //! handler chosen by router, valid while routed_
+    mf_handler *route_handler_;
+
+    //! router matched current request already
+    bool routed_;
+
+    //! first error of stdin or data sink
+    int sink_status_;
+
+    //! QUERY_STRING args, parsed on first access
+    mf_params_t query_args_;
+
+    //! decoded values of query_args_, data is NULL for not decoded yet
+    std::vector<mf_strview> query_values_;
+
+    //! HTTP_COOKIE cookies, parsed on first access
+    mf_params_t cookies_;
+
+    //! decoded values of cookies_, data is NULL for not decoded yet
+    std::vector<mf_strview> cookie_values_;
+
+    //! query_args_ is parsed
+    bool query_parsed_;
+
+    //! cookies_ is parsed
+    bool cookies_parsed_;
+
+    //! scratch memory of current request
+    mf_arena arena_;
+
+    //! find arg and decode its value on first read
+    mf_strview decode_arg_(const mf_params_t &args, std::vector<mf_strview> &values, const char *name, bool plus);
+
+    //! initial buffer size
+    int buf_size_;
+
+    //! fill request_params_ or not
+    bool materialize_;
+
+    //! parse params_buf_
+    int parse_params(int len);
+
   public:
 
+    /*! ctor
+    \param buf_size   initial buffer size
+    \param materialize   fill request_params() besides params(), false for index only
+    */
+    explicit mf_reader(int buf_size = mf_default_config::reader_buf_size, bool materialize = true);
+
+    /*! read record header
+    \param ctx   mf_context object, header and request_id is set
+    \return FCGI_HEADER_LEN for ok; others for error status in mf_status
+    */
+    int read_header(mf_context *ctx);
+
+    /*! read body of begin request record
+    \param ctx   mf_context object, role and flags is set
+    \return >0 for total bytes readed; others for error status in mf_status
+    */
+    int read_begin_request(mf_context *ctx);
+
     /*! read record body
     \param ctx   mf_context object with header info
     \return >0 for total bytes readed; others for error status in mf_status
@@ -160,7 +360,7 @@ class mf_reader {
     */
     int read_record_params(mf_context *ctx);
 
-    /*! read params from fd
+    /*! read params from fd into params() index, request_params() is filled by materialize_params()
     \param ctx   mf_context object
     \return >0 for total bytes readed; others for error status in mf_status
     */
@@ -172,12 +372,112 @@ class mf_reader {
     */
     int read_stdin(mf_context *ctx);
 
+    /*! stream stdin from fd record by record, request_stdin() is left empty.
+    after sink error the rest is drained and the error is kept in sink_status()
+    \param ctx   mf_context object
+    \param sink   receiver of content, NULL for reading into request_stdin()
+    \return for total bytes readed; others for error status in mf_status
+    */
+    int read_stdin(mf_context *ctx, mf_stream_sink *sink);
+
     /*! read data from fd
     \param ctx   mf_context object
     \return for total bytes readed; others for error status in mf_status
     */
     int read_data(mf_context *ctx);
 
+    /*! stream data from fd record by record, request_data() is left empty,
+    sink error is kept as read_stdin() does
+    \param ctx   mf_context object
+    \param sink   receiver of content, NULL for reading into request_data()
+    \return for total bytes readed; others for error status in mf_status
+    */
+    int read_data(mf_context *ctx, mf_stream_sink *sink);
+
+    /*! read and drop records of type record by record, e.g. body of rejected request
+    \param ctx   mf_context object
+    \param type   record type, FCGI_STDIN or FCGI_DATA
+    \return for total bytes readed; others for error status in mf_status
+    */
+    int skip_records(mf_context *ctx, int type);
+
+    //! params index, views into param_buf()
+    const mf_params_t &params() const {
+        return params_index_;
+    }
+
+    /*! find param in index without building strings
+    \param name   param name
+    \return  view of value, data is NULL for not found
+    */
+    mf_strview param(const char *name) const;
+
+    //! path segments captured by mf_router, values are views into param_buf()
+    const mf_params_t &route_args() const {
+        return route_args_;
+    }
+
+    //! path segments captured by mf_router, values are views into param_buf()
+    mf_params_t &route_args() {
+        return route_args_;
+    }
+
+    /*! find captured path segment
+    \param name   name in route pattern
+    \return  view of segment, data is NULL for not found
+    */
+    mf_strview route_arg(const char *name) const;
+
+    /*! handler chosen by mf_router for current request
+    \param handler   routed handler, NULL for no route
+    \return  true for routed already
+    */
+    bool routed(mf_handler *&handler) const {
+        handler = route_handler_;
+        return routed_;
+    }
+
+    //! first error returned by stdin or data sink of current request, MF_OK for none
+    int sink_status() const {
+        return sink_status_;
+    }
+
+    //! keep handler chosen by mf_router until next request
+    void set_routed(mf_handler *handler) {
+        route_handler_ = handler;
+        routed_ = true;
+    }
+
+    /*! QUERY_STRING args, values are views into param_buf() and not decoded
+    \return  args, QUERY_STRING is parsed on first access
+    */
+    const mf_params_t &query_args();
+
+    /*! find QUERY_STRING arg, value is percent-decoded on first read
+    \param name   arg name, compared without decoding
+    \return  view of value, data is NULL for not found
+    */
+    mf_strview query_arg(const char *name);
+
+    /*! HTTP_COOKIE cookies, values are views into param_buf() and not decoded
+    \return  cookies, HTTP_COOKIE is parsed on first access
+    */
+    const mf_params_t &cookies();
+
+    /*! find cookie, value is percent-decoded on first read
+    \param name   cookie name
+    \return  view of value, data is NULL for not found
+    */
+    mf_strview cookie(const char *name);
+
+    //! scratch memory of current request
+    mf_arena &arena() {
+        return arena_;
+    }
+
+    //! fill request_params() from params() index when materialized, basic_mtfcgi calls it after rate limiting
+    void materialize_params();
+
     //! params result
     const kvmap_t &request_params() const {
         return request_params_;
@@ -212,6 +512,91 @@ class mf_reader {
     mfbuf_t &param_buf() {
         return params_buf_;
     }
+
+    //! release buffers, they will be allocated again by the calling thread
+    void reallocate();
+};
+
+/*! per connection output queue for slow clients
+
+writer appends what the socket can't take at once and returns immediately;
+event loop calls drain() when the fd becomes writable(EPOLLOUT) and must not
+handle next request on the connection before the queue becomes empty.
+*/
+class mf_outqueue {
+    //! queued data in memory
+    std::deque<mfbuf_t> chunks_;
+
+    //! sent bytes of front chunk
+    size_t head_sent_;
+
+    //! queued bytes in memory
+    size_t mem_size_;
+
+    //! spill file, -1 for none
+    int spill_fd_;
+
+    //! read offset of spill file
+    off_t spill_read_;
+
+    //! write offset of spill file
+    off_t spill_write_;
+
+    //! memory limit, backlog beyond it spills to temp file
+    size_t mem_limit_;
+
+    //! total limit of queued bytes
+    size_t total_limit_;
+
+    //! directory of spill file
+    std::string spill_dir_;
+
+    //! append data to memory or spill file
+    int push_(const char *data, size_t len);
+
+    //! noncopyable
+    mf_outqueue(const mf_outqueue &);
+    mf_outqueue &operator=(const mf_outqueue &);
+
+  public:
+
+    /*! ctor
+    \param mem_limit   memory limit in bytes
+    \param total_limit   limit of memory and spill file in bytes
+    \param spill_dir   directory of spill file
+    */
+    explicit mf_outqueue(size_t mem_limit = 1 << 20, size_t total_limit = 64 << 20, const char *spill_dir = "/tmp");
+
+    //! dtor
+    ~mf_outqueue();
+
+    /*! write data without blocking, what can't be sent now is queued
+    \param fd   file descriptor
+    \param iov   data
+    \param count   count of iov
+    \param more   more data will follow(MSG_MORE)
+    \return >0 for total bytes sent or queued; others for error status in mf_status
+    */
+    int write(int fd, const struct iovec *iov, int count, bool more);
+
+    /*! send queued data without blocking, fd is set to nonblocking once data has spilled
+    \param fd   file descriptor
+    \return >0 for bytes still queued; 0 for empty; others for error status in mf_status
+    */
+    int drain(int fd);
+
+    //! total queued bytes
+    size_t size() const {
+        return mem_size_ + static_cast<size_t>(spill_write_ - spill_read_);
+    }
+
+    //! queue is empty
+    bool empty() const {
+        return size() == 0;
+    }
+
+    //! drop queued data
+    void clear();
 };
 
 /*! mtfcgi writer
@@ -220,6 +605,12 @@ class mf_writer {
     //! writer buffer
     mfbuf_t buf_;
 
+    //! coalesce records of unfinished request into full segments(MSG_MORE)
+    bool cork_;
+
+    //! output queue, NULL for blocking write
+    mf_outqueue *queue_;
+
   public:
 
     /*!  write tag
@@ -230,8 +621,33 @@ class mf_writer {
         FINISHED/*!< write finished record . */
     };
 
-    //! ctor
-    mf_writer();
+    /*! ctor
+    \param buf_size   buffer size, multiple of 8 and no more than 0xFFF8
+    */
+    explicit mf_writer(int buf_size = mf_default_config::writer_buf_size);
+
+    //! allocate buffer again by the calling thread
+    void reallocate();
+
+    /*! coalesce NIL/CLOSED records with the FINISHED record(MSG_MORE),
+    turn it off for progressive output of long running requests
+    \param on   default true
+    */
+    void cork(bool on) {
+        cork_ = on;
+    }
+
+    //! coalesce records or not
+    bool corked() const {
+        return cork_;
+    }
+
+    /*! hand output to queue instead of waiting for slow client
+    \param queue   output queue of current connection, NULL for blocking write
+    */
+    void set_queue(mf_outqueue *queue) {
+        queue_ = queue;
+    }
 
     /*! write fastcgi record
     \param ctx   mf_context object
@@ -272,6 +688,39 @@ class mf_writer {
     int write_finished_record(mf_context *ctx, const void *data = NULL, int len = 0) {
         return write_finished_record(ctx, data, len, NULL);
     }
+
+    /*! write unknown type record for the management record in ctx->header
+    \param ctx   mf_context object
+    \return return >0 for total bytes readed; others for error status in mf_status
+    */
+    int write_unknown_type(mf_context *ctx);
+};
+
+/*! default behaviors of mtfcgi handler without virtual functions,
+base of handler types used by basic_mtfcgi directly
+*/
+struct mf_handler_base {
+    //! buffer stdin in reader
+    static mf_stream_sink *stdin_sink(mf_context *, mf_reader *, mf_writer *) {
+        return NULL;
+    }
+
+    //! buffer filter data in reader
+    static mf_stream_sink *data_sink(mf_context *, mf_reader *, mf_writer *) {
+        return NULL;
+    }
+
+    //! answer MF_UNSUPPORTED_AUTH
+    static int on_auth(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+
+    //! answer MF_UNSUPPORTED_FILTER
+    static int on_filter(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+
+    //! answer FCGI_GET_VALUES
+    static int on_management(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+
+    //! answer FCGI_CANT_MPX_CONN
+    static int on_multiconnect(mf_context *ctx, mf_reader *reader, mf_writer *writer);
 };
 
 /*! mtfcgi handler
@@ -290,6 +739,26 @@ struct mf_handler {
     */
     virtual int on_response(mf_context *ctx, mf_reader *reader, mf_writer *writer) = 0;
 
+    /*! called after params are read, to stream stdin instead of buffering it.
+    when sink fails, stdin is still drained and on_response is called with the error in reader->sink_status()
+    \param ctx   mf_context object
+    \param reader  mtfcgi reader
+    \param writer  mtfcgi writer
+    \return receiver of stdin content; NULL for reading into request_stdin()(default)
+    */
+    virtual mf_stream_sink *stdin_sink(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+
+    /*! called after stdin is read when role is Filter, to stream FCGI_DATA instead of buffering it.
+    sink may write transformed output by writer with NIL tag as data arrives(FCGI_DATA_LENGTH param
+    is the total size), then on_filter is called to write the FINISHED record.
+    basic_mtfcgi turns writer cork off while a sink is streaming, so its output is not held back
+    \param ctx   mf_context object
+    \param reader  mtfcgi reader
+    \param writer  mtfcgi writer
+    \return receiver of data content; NULL for reading into request_data()(default)
+    */
+    virtual mf_stream_sink *data_sink(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+
     /*! when role is Authorizer
     \param ctx   mf_context object
     \param reader  mtfcgi reader
@@ -323,9 +792,97 @@ struct mf_handler {
     virtual int on_multiconnect(mf_context *ctx, mf_reader *reader, mf_writer *writer);
 };
 
+/*! pin calling thread to one cpu and prefer memory of its numa node
+\param cpu   cpu index
+\return  MF_OK for ok; MF_ERROR for error, maybe get futher error detail by errno
+*/
+int mf_bind_cpu(int cpu);
+
+/*! per client token bucket rate limiter, shared by threads without lock
+
+buckets live in a fixed table split into shards, each client key is hashed to a shard and
+probes a few slots there; when they are all taken by other clients a fully refilled bucket is
+reclaimed, else the fullest one is shared, so the limit is approximate under table pressure.
+*/
+class mf_rate_limiter {
+    /*! bucket slot
+    */
+    struct slot {
+        //! hash of client key, 0 for free
+        volatile uint64_t key;
+
+        //! milli tokens(high 24 bits) and last refill time in millisecond(low 40 bits), 0 for new
+        volatile uint64_t state;
+    };
+
+    //! slots
+    slot *slots_;
+
+    //! shard count
+    size_t shard_count_;
+
+    //! slots of one shard
+    size_t shard_size_;
+
+    //! refill rate in milli tokens per millisecond(tokens per second)
+    double rate_;
+
+    //! bucket size in milli tokens
+    uint64_t burst_;
+
+    //! param holding client key
+    std::string key_param_;
+
+    //! time base of state, monotonic
+    int64_t start_ms_;
+
+    //! noncopyable
+    mf_rate_limiter(const mf_rate_limiter &);
+    mf_rate_limiter &operator=(const mf_rate_limiter &);
+
+  public:
+
+    /*! ctor
+    \param rate   tokens per second
+    \param burst   bucket size in tokens, less than 16777
+    \param key_param   param holding client key
+    \param capacity   total buckets
+    \param shard_count   shard count
+    */
+    mf_rate_limiter(double rate, int burst, const char *key_param = "REMOTE_ADDR", size_t capacity = 65536, size_t shard_count = 64);
+
+    //! dtor
+    ~mf_rate_limiter();
+
+    /*! take one token of client, a new client finding no free or idle bucket shares the fullest probed one
+    \param key   client key
+    \param len   key len
+    \return  true for allowed
+    */
+    bool allow(const char *key, int len);
+
+    /*! take one token of client by key param, request without key param is allowed
+    \param reader   mtfcgi reader with params
+    \return  true for allowed
+    */
+    bool allow(const mf_reader &reader);
+
+    /*! answer 429, body is dropped record by record first, or closing the socket with unread data
+    may reset the connection before the answer is read
+    \param ctx   mf_context object
+    \param reader  mtfcgi reader
+    \param writer  mtfcgi writer
+    \return >=0 for ok; others for error status in mf_status
+    */
+    int reject(mf_context *ctx, mf_reader *reader, mf_writer *writer);
+};
+
 /*! multithread fastcgi class
+\tparam Handler   handler type, calls are inlined unless they are virtual
+\tparam Config   compile-time configuration like mf_default_config
 */
-struct mtfcgi {
+template<class Handler, class Config = mf_default_config>
+struct basic_mtfcgi {
     //! context object
     mf_context ctx;
 
@@ -335,13 +892,177 @@ struct mtfcgi {
     //! writer object
     mf_writer writer;
 
+    //! rate limiter checked after params are read, NULL for none
+    mf_rate_limiter *limiter;
+
+    //! span ring of this thread, NULL for not traced
+    mf_trace_ring *trace;
+
+    //! ctor
+    basic_mtfcgi()
+        : reader(Config::reader_buf_size, Config::materialize_params != 0), writer(Config::writer_buf_size), limiter(NULL), trace(NULL) {
+    }
+
     /*! handle web connection for fastcgi protocol
     \param fd   file descriptor
     \param timeout_ms   timeout in millisecond
     \param handler   customized handler
     \return  >=0 for ok; others for error status in mf_status
     */
-    int handle(int fd, int timeout_ms, mf_handler *handler);
+    int handle(int fd, int timeout_ms, Handler *handler);
+
+    /*! pin calling thread to one cpu and reallocate buffers on its numa node
+    \param cpu   cpu index
+    \return  MF_OK for ok; MF_ERROR for error, maybe get futher error detail by errno
+    */
+    int bind_cpu(int cpu) {
+        const int ret = mf_bind_cpu(cpu);
+
+        if (ret == MF_OK) {
+            reader.reallocate();
+            writer.reallocate();
+        }
+
+        return ret;
+    }
 };
 
+//! multithread fastcgi class with virtual handler
+typedef basic_mtfcgi<mf_handler> mtfcgi;
+
+template<class Handler, class Config>
+int basic_mtfcgi<Handler, Config>::handle(int fd, int timeout_ms, Handler *handler) {
+    ctx.reset(fd, timeout_ms);
+    ctx.span = (trace ? trace->begin() : NULL);
+    MF_TRACE_PROBE1(request__start, fd);
+
+    while (true) {
+        if ((ctx.app_status = reader.read_header(&ctx)) != FCGI_HEADER_LEN) {
+            break;
+        }
+
+        MF_TRACE_STAGE(ctx, header, ctx.header.type);
+
+        if (ctx.header.type == FCGI_BEGIN_REQUEST) {//handle app reqeust
+            //check id!=0
+            if (ctx.request_id == FCGI_NULL_REQUEST_ID) {
+                ctx.app_status = MF_REQUSET_ID_ERROR;
+                break;
+            }
+
+            //read body info
+            if ((ctx.app_status = reader.read_begin_request(&ctx)) < 0) {
+                break;
+            }
+
+            // read params info
+            ctx.app_status = reader.read_params(&ctx);
+            MF_TRACE_STAGE(ctx, params, ctx.app_status);
+
+            if (ctx.app_status < 0) {
+                break;
+            }
+
+            if (limiter && !limiter->allow(reader)) {
+                ctx.app_status = limiter->reject(&ctx, &reader, &writer);
+                break;
+            }
+
+            reader.materialize_params(); //rejected request never pays for strings
+
+            switch (ctx.role) {//handle role request
+                case FCGI_RESPONDER:
+                    ctx.app_status = reader.read_stdin(&ctx, handler->stdin_sink(&ctx, &reader, &writer));
+                    MF_TRACE_STAGE(ctx, stdin, ctx.app_status);
+
+                    if (ctx.app_status > 0) {
+                        ctx.app_status = handler->on_response(&ctx, &reader, &writer);
+                        MF_TRACE_STAGE(ctx, handler, ctx.app_status);
+                    }
+
+                    break;
+
+                case FCGI_AUTHORIZER:
+                    ctx.app_status = handler->on_auth(&ctx, &reader, &writer);
+                    MF_TRACE_STAGE(ctx, handler, ctx.app_status);
+                    break;
+
+                case FCGI_FILTER:
+                    if ((ctx.app_status = reader.read_stdin(&ctx, handler->stdin_sink(&ctx, &reader, &writer))) > 0) {
+                        mf_stream_sink *sink = handler->data_sink(&ctx, &reader, &writer);
+                        const bool corked = writer.corked();
+                        writer.cork(corked && sink == NULL); //progressive output of sink
+                        ctx.app_status = reader.read_data(&ctx, sink);
+                        writer.cork(corked);
+                    }
+
+                    MF_TRACE_STAGE(ctx, stdin, ctx.app_status);
+
+                    if (ctx.app_status > 0) {
+                        ctx.app_status = handler->on_filter(&ctx, &reader, &writer);
+                        MF_TRACE_STAGE(ctx, handler, ctx.app_status);
+                    }
+
+                    break;
+
+                default://bad role
+                    ctx.protocol_status = FCGI_UNKNOWN_ROLE;
+                    ctx.app_status = writer.write_finished_record(&ctx);
+                    break;
+            }
+
+            break;
+        } else if (ctx.request_id == FCGI_NULL_REQUEST_ID) {//handle management request
+            if (ctx.header.type == FCGI_GET_VALUES) {
+                ctx.app_status = handler->on_management(&ctx, &reader, &writer);
+            } else {
+                ctx.app_status = writer.write_unknown_type(&ctx);
+            }
+
+            break;
+        } else {//handle ignored request
+            if ((ctx.app_status = reader.read_record_body(&ctx)) < 0) {
+                break;
+            }
+        }
+    }
+
+    if (ctx.app_status == MF_UNSUPPORTED_MPX_CONN) {
+        ctx.app_status = handler->on_multiconnect(&ctx, &reader, &writer);
+    }
+
+    MF_TRACE_PROBE2(request__done, ctx.request_id, ctx.app_status);
+
+    if (ctx.span) {
+        ctx.span->request_id = ctx.request_id;
+        ctx.span->role = ctx.role;
+        ctx.span->app_status = ctx.app_status;
+        ctx.span->protocol_status = ctx.protocol_status;
+        trace->commit();
+        ctx.span = NULL;
+    }
+
+    return ctx.app_status;
+}
+
+/*! create anonymous temp file
+\param dir   directory
+\return  >=0 for fd; MF_ERROR for error, maybe get futher error detail by errno
+*/
+int mf_mktemp(const char *dir);
+
+/*! get the cpu which handled the rx queue of a connection(SO_INCOMING_CPU)
+\param fd   accepted socket
+\return  >=0 for cpu index; MF_ERROR for error, maybe get futher error detail by errno
+*/
+int mf_get_incoming_cpu(int fd);
+
+/*! only accept connections from rx queues handled by the cpu(SO_INCOMING_CPU),
+used with one SO_REUSEPORT listen socket per worker
+\param fd   listen socket
+\param cpu   cpu index
+\return  MF_OK for ok; MF_ERROR for error, maybe get futher error detail by errno
+*/
+int mf_set_incoming_cpu(int fd, int cpu);
+
 #endif //__MTFCGI_H__
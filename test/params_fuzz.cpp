@@ -0,0 +1,197 @@
+/*!  \file params_fuzz.cpp
+\brief FCGI_PARAMS decoder equivalence fuzz and throughput benchmark
+\author zhaohongchao(zadezhao@qq.com)
+\date 2026/10/18 22:10:37
+\version 1.0.0.0
+\since 1.0.0.0
+
+standalone program, mtfcgi.cpp is included to reach the decoder:
+
+    g++ -O2 -I. -Ipath/to/fastcgi test/params_fuzz.cpp mf_trace.cpp -o params_fuzz && ./params_fuzz [iterations]
+
+random and mutated(truncated, corrupted) params blocks are decoded by parse_params_ and
+by a plain one-length-at-a-time reference decoder, status and every view must be the same.
+exit status is 0 for no difference.
+*/
+#include "../mtfcgi.cpp"
+
+#include <stdlib.h>//for rand
+#include <time.h>//for clock
+
+//! anonymouse namespace
+namespace {
+
+//! read one param length, -1 for truncated
+long reference_len_(const unsigned char *&pos, const unsigned char *end) {
+    if (pos >= end) {
+        return -1;
+    } else if ((*pos & 0x80) == 0) {
+        return *pos++;
+    } else if (end - pos < 4) {
+        return -1;
+    }
+
+    const long len = (static_cast<long>(pos[0] & 0x7f) << 24) + (pos[1] << 16) + (pos[2] << 8) + pos[3];
+    pos += 4;
+
+    return len;
+}
+
+//! reference decoder, empty names are skipped as parse_params_ does
+int reference_parse_(const mfbuf_t &buf, mf_params_t &index) {
+    const unsigned char *pos = reinterpret_cast<const unsigned char *>(&buf.front());
+    const unsigned char *end = pos + buf.size();
+
+    while (pos < end) {
+        const long name_len = reference_len_(pos, end);
+        const long value_len = (name_len < 0 ? -1 : reference_len_(pos, end));
+
+        if (value_len < 0 || name_len > end - pos || value_len > end - pos - name_len) {
+            return MF_PARAMS_ERROR;
+        }
+
+        if (name_len != 0) {
+            mf_param param;
+            param.name.data = reinterpret_cast<const char *>(pos);
+            param.name.len = static_cast<int>(name_len);
+            param.value.data = param.name.data + name_len;
+            param.value.len = static_cast<int>(value_len);
+            index.push_back(param);
+        }
+
+        pos += name_len + value_len;
+    }
+
+    return MF_OK;
+}
+
+//! append param length
+void append_len_(std::string &out, size_t len) {
+    if (len > 127) {
+        out += static_cast<char>(0x80 | (len >> 24));
+        out += static_cast<char>(len >> 16);
+        out += static_cast<char>(len >> 8);
+    }
+
+    out += static_cast<char>(len);
+}
+
+//! random params block, maybe truncated or corrupted
+std::string random_block_() {
+    std::string out;
+    const int count = rand() % 80;
+
+    for (int i = 0; i != count; ++i) {
+        const size_t name_len = (rand() % 4 == 0 ? 128 + rand() % 300 : rand() % 20);
+        const size_t value_len = (rand() % 3 == 0 ? 128 + rand() % 500 : rand() % 30);
+        append_len_(out, name_len);
+        append_len_(out, value_len);
+
+        for (size_t j = 0; j != name_len + value_len; ++j) {
+            out += static_cast<char>(rand());
+        }
+    }
+
+    if (!out.empty()) {
+        switch (rand() % 4) {
+            case 1:
+                out.resize(rand() % out.size());
+                break;
+
+            case 2:
+                out[rand() % out.size()] = static_cast<char>(rand());
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return out;
+}
+
+//! same status and views
+bool same_(int ret1, const mf_params_t &index1, int ret2, const mf_params_t &index2) {
+    if (ret1 != ret2 || (ret1 == MF_OK && index1.size() != index2.size())) {
+        return false;
+    }
+
+    for (size_t i = 0; ret1 == MF_OK && i != index1.size(); ++i) {
+        if (index1[i].name.data != index2[i].name.data || index1[i].name.len != index2[i].name.len
+                || index1[i].value.data != index2[i].value.data || index1[i].value.len != index2[i].value.len) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//! ns per decoded block
+double bench_(const mfbuf_t &buf, int (*parse)(const mfbuf_t &, mf_params_t &), int rounds) {
+    mf_params_t index;
+    index.reserve(64);
+    size_t total = 0;
+    const clock_t start = clock();
+
+    for (int i = 0; i != rounds; ++i) {
+        index.clear();
+        parse(buf, index);
+        total += index.size();
+    }
+
+    const double ns = (clock() - start) * 1e9 / CLOCKS_PER_SEC / rounds;
+    return (total == 0 ? -1 : ns);
+}
+}
+
+int main(int argc, char *argv[]) {
+    const int iterations = (argc > 1 ? atoi(argv[1]) : 300000);
+    int valid = 0;
+    int diffs = 0;
+    srand(1);
+
+    for (int i = 0; i != iterations; ++i) {
+        const std::string block = random_block_();
+
+        if (block.empty()) {
+            continue;
+        }
+
+        const mfbuf_t buf(block.begin(), block.end());
+        mf_params_t index1;
+        mf_params_t index2;
+        const int ret1 = reference_parse_(buf, index1);
+        const int ret2 = parse_params_(buf, index2);
+
+        if (ret1 == MF_OK) {
+            ++valid;
+        }
+
+        if (!same_(ret1, index1, ret2, index2) && ++diffs <= 5) {
+            printf("diff at %d: reference=%d parse_params_=%d size=%d\n", i, ret1, ret2, static_cast<int>(block.size()));
+        }
+    }
+
+    printf("blocks=%d valid=%d diffs=%d\n", iterations, valid, diffs);
+
+    //typical web server params, 19 short pairs
+    const char *names[] = {"SCRIPT_FILENAME", "QUERY_STRING", "REQUEST_METHOD", "CONTENT_TYPE", "CONTENT_LENGTH",
+                           "SCRIPT_NAME", "REQUEST_URI", "DOCUMENT_URI", "DOCUMENT_ROOT", "SERVER_PROTOCOL", "REMOTE_ADDR",
+                           "REMOTE_PORT", "SERVER_ADDR", "SERVER_PORT", "SERVER_NAME", "HTTP_HOST", "HTTP_USER_AGENT",
+                           "HTTP_ACCEPT", "HTTP_COOKIE"
+                          };
+    std::string block;
+
+    for (size_t i = 0; i != sizeof(names) / sizeof(names[0]); ++i) {
+        const std::string value(10 + i * 3, 'v');
+        append_len_(block, strlen(names[i]));
+        append_len_(block, value.size());
+        block += names[i];
+        block += value;
+    }
+
+    const mfbuf_t buf(block.begin(), block.end());
+    printf("19 params: reference %.1f ns, parse_params_ %.1f ns\n", bench_(buf, reference_parse_, 2000000), bench_(buf, parse_params_, 2000000));
+
+    return diffs == 0 ? 0 : 1;
+}